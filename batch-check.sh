@@ -0,0 +1,38 @@
+#!/bin/sh
+# Checks that batch mode runs a scenario the same as a plain run, with the
+# batch command line options added but not overriding the scenario's own
+#
+#   ./batch-check.sh
+
+SIM=${SIM:-./sim}
+SCENARIO="1 poisson 100000 uniform poisson 120000"
+
+# The plain run's output lines joined the way batch mode joins them
+row() {
+    $SIM $SCENARIO "$@" | awk '{ printf "%s%s", (NR > 1 ? " | " : ""), $0 } END { printf "\n" }'
+}
+
+check() {
+    name=$1
+    want=$2
+    got=$3
+    if [ "$got" != "$want" ]; then
+        echo "$name: FAILED"
+        echo "  want: $want"
+        echo "  got:  $got"
+        failed=1
+    else
+        echo "$name: ok"
+    fi
+}
+
+failed=0
+
+want="a $(row --seed=1 --limit=10)"
+got=$(echo "a $SCENARIO --seed=1" | $SIM --batch --workers=1 --limit=10)
+check "common option added" "$want" "$got"
+
+got=$(echo "a $SCENARIO --seed=1" | $SIM --batch --workers=1 --seed=3)
+check "scenario option wins" "a $(row --seed=1)" "$got"
+
+exit $failed
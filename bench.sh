@@ -0,0 +1,111 @@
+#!/bin/sh
+# Runs the golden scenarios with fixed seeds and compares the total latencies
+# against the stored goldens, and wall time, events per second and peak RSS
+# against the local baseline. Exits non-zero when any of them regressed by
+# more than the thresholds or a run failed
+#
+#   ./bench.sh [--update] [--golden]
+#
+# THRESHOLD is the allowed slowdown or growth in percent (20), LATENCY the
+# allowed latency change in percent (1), REPEAT the number of runs of which
+# the fastest counts (5). Timings are machine specific, so the baseline is
+# not stored with the sources. It is written by the first run and rewritten
+# with --update. --golden rewrites the goldens instead, for when the model
+# changed on purpose
+
+SIM=${SIM:-./sim}
+GOLDEN=${GOLDEN:-bench.golden}
+BASELINE=${BASELINE:-bench.baseline}
+THRESHOLD=${THRESHOLD:-20}
+LATENCY=${LATENCY:-1}
+REPEAT=${REPEAT:-5}
+TIME=5
+SEED=1
+
+# name wall events/s rss(KB) mean(us) p99(us)
+measure() {
+    name=$1
+    shift
+    out=$(mktemp)
+    i=0
+    while [ $i -lt "$REPEAT" ]; do
+        if ! $SIM $TIME "$@" --seed=$SEED --self-profile >> "$out"; then
+            echo "$name: $SIM failed" >&2
+            rm -f "$out"
+            exit 1
+        fi
+        i=$((i + 1))
+    done
+    awk -v name="$name" '
+        /^total latencies/ { mean = $4 * 1e6; p99 = $8 * 1e6 }
+        /^self-profile: wall/ {
+            wall = $3 + 0
+            eps = $8; gsub(/[(\/s)]/, "", eps)
+            rss = $11 + 0
+            if (best == "" || wall < best) { best = wall; beps = eps }
+            if (rss > brss) brss = rss
+        }
+        END { printf "%s %.3f %.0f %d %.1f %.1f\n", name, best, beps, brss, mean, p99 }' "$out"
+    rm -f "$out"
+}
+
+results=$(while read -r name scenario; do
+    case "$name" in ''|'#'*) continue ;; esac
+    measure $name $scenario
+done <<SCENARIOS
+# name            producer rate dispatcher consumer rate
+underload         poisson 50000 uniform poisson 120000
+saturation        poisson 115000 uniform poisson 120000
+overload          poisson 360000 uniform poisson 120000
+uniform           uniform 100000 uniform uniform 120000
+poisson-dispatch  poisson 100000 poisson poisson 120000
+expdelay          expdelay 50000 uniform expdelay 60000
+capdelay          capdelay 50000 uniform capdelay 60000
+SCENARIOS
+) || exit 1
+
+if [ "$1" = "--golden" ] || [ ! -f "$GOLDEN" ]; then
+    echo "$results" | awk '{ print $1, $5, $6 }' > "$GOLDEN"
+    echo "goldens written to $GOLDEN"
+fi
+if [ "$1" = "--update" ] || [ ! -f "$BASELINE" ]; then
+    echo "$results" | awk '{ print $1, $2, $3, $4 }' > "$BASELINE"
+    echo "baseline written to $BASELINE"
+fi
+
+echo "$results" | awk -v threshold="$THRESHOLD" -v latency="$LATENCY" -v baseline="$BASELINE" -v golden="$GOLDEN" '
+    BEGIN {
+        while ((getline line < baseline) > 0) {
+            split(line, f)
+            base[f[1]] = line
+        }
+        while ((getline line < golden) > 0) {
+            split(line, f)
+            gold[f[1]] = line
+        }
+        printf "%-17s %9s %12s %9s %10s %10s\n", "scenario", "wall", "events/s", "rss", "mean", "p99"
+    }
+    # Change against the baseline in percent, marked when worse than limit
+    function cmp(now, was, limit, higher_is_worse,    d, bad) {
+        d = was > 0 ? (now - was) / was * 100 : 0
+        bad = higher_is_worse > 0 ? d > limit : (higher_is_worse < 0 ? -d > limit : (d > limit || -d > limit))
+        if (bad) failed = 1
+        return sprintf("%+8.1f%%%s", d, bad ? "!" : " ")
+    }
+    {
+        if (!($1 in base) || !($1 in gold)) {
+            printf "%-17s not in baseline or goldens\n", $1
+            failed = 1
+            next
+        }
+        split(base[$1], b)
+        split(gold[$1], g)
+        printf "%-17s %s %s %s %s %s\n", $1, cmp($2, b[2], threshold, 1), cmp($3, b[3], threshold, -1),
+                cmp($4, b[4], threshold, 1), cmp($5, g[2], latency, 0), cmp($6, g[3], latency, 0)
+    }
+    END {
+        if (failed) {
+            print "regressions beyond the thresholds, marked with !"
+            exit 1
+        }
+    }'
@@ -0,0 +1,215 @@
+#include <fmt/core.h>
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "histogram.hh"
+#include "options.hh"
+#include "profile.hh"
+#include "uring.hh"
+
+using namespace std::chrono;
+
+static std::vector<unsigned long> parse_list(std::string spec) {
+    std::vector<unsigned long> ret;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        ret.push_back(std::stoul(item));
+    }
+    return ret;
+}
+
+// Regular files are filled with data so that reads really hit the disk
+// instead of returning zeroes for holes
+static unsigned long prepare_file(std::string path, unsigned long size) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error(fmt::format("cannot open {}: {}", path, strerror(errno)));
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    if (S_ISBLK(st.st_mode)) {
+        unsigned long bsize;
+        ioctl(fd, BLKGETSIZE64, &bsize);
+        close(fd);
+        return bsize;
+    }
+
+    if ((unsigned long)st.st_size < size) {
+        fmt::print(stderr, "filling {} with {} bytes\n", path, size);
+        std::vector<char> buf(1 << 20, 'x');
+        for (unsigned long off = 0; off < size;) {
+            auto written = pwrite(fd, buf.data(), std::min<unsigned long>(buf.size(), size - off), off);
+            if (written < 0) {
+                throw std::runtime_error(fmt::format("cannot fill {}: {}", path, strerror(errno)));
+            }
+            off += written;
+        }
+        fsync(fd);
+        st.st_size = size;
+    }
+    close(fd);
+    return st.st_size;
+}
+
+class capture {
+    int _fd;
+    unsigned long _file_size;
+    uring _ring;
+    std::vector<void*> _bufs;
+    std::vector<steady_clock::time_point> _sent;
+    std::mt19937 _rng;
+
+public:
+    capture(std::string path, unsigned long file_size, unsigned max_depth, unsigned long max_size, bool write)
+            : _file_size(file_size)
+            , _ring(max_depth)
+            , _bufs(max_depth)
+            , _sent(max_depth)
+            , _rng(std::random_device()())
+    {
+        _fd = open(path.c_str(), (write ? O_RDWR : O_RDONLY) | O_DIRECT);
+        if (_fd < 0) {
+            throw std::runtime_error(fmt::format("cannot open {}: {}", path, strerror(errno)));
+        }
+
+        std::vector<iovec> iov(max_depth);
+        for (unsigned i = 0; i < max_depth; i++) {
+            if (posix_memalign(&_bufs[i], 4096, max_size) != 0) {
+                throw std::runtime_error("cannot allocate buffers");
+            }
+            memset(_bufs[i], 'x', max_size);
+            iov[i] = iovec{_bufs[i], max_size};
+        }
+        _ring.register_buffers(iov.data(), iov.size());
+    }
+
+    ~capture() {
+        for (auto b : _bufs) {
+            free(b);
+        }
+        close(_fd);
+    }
+
+    // Keeps exactly depth requests in flight for the given time, every reaped
+    // completion is resubmitted in the same batch right away
+    histogram run(unsigned char opcode, unsigned long size, unsigned depth, duration<double> warmup, duration<double> time) {
+        std::uniform_int_distribution<unsigned long> pos(0, _file_size / size - 1);
+        histogram hist;
+        unsigned inflight = 0;
+
+        auto send = [&] (unsigned slot) {
+            _ring.prepare(opcode, _fd, _bufs[slot], size, pos(_rng) * size, slot, slot);
+            inflight++;
+        };
+
+        for (unsigned slot = 0; slot < depth; slot++) {
+            send(slot);
+        }
+        auto start = steady_clock::now();
+        for (unsigned slot = 0; slot < depth; slot++) {
+            _sent[slot] = start;
+        }
+        _ring.submit();
+
+        bool stopping = false;
+        while (inflight > 0) {
+            _ring.submit(1);
+            auto now = steady_clock::now();
+            stopping |= now - start >= warmup + time;
+
+            _ring.reap([&] (unsigned long slot, int res) {
+                inflight--;
+                if (res < 0) {
+                    throw std::runtime_error(fmt::format("io failed: {}", strerror(-res)));
+                }
+                if (_sent[slot] - start >= warmup) {
+                    hist.add(duration_cast<nanoseconds>(now - _sent[slot]));
+                }
+                if (!stopping) {
+                    send(slot);
+                    _sent[slot] = now;
+                }
+            });
+        }
+
+        return hist;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fmt::print("usage: {} <file or block device> [--option=value ...]\n", argv[0]);
+        return 1;
+    }
+
+    std::string path = argv[1];
+    options opts(argc, argv, 2);
+    auto ops = opts.get("ops", std::string("read"));
+    auto sizes = parse_list(opts.get("sizes", std::string("4096")));
+    auto depths = parse_list(opts.get("depths", std::string("1,2,4,8,16,32,64,128")));
+    duration<double> time(opts.get("time", 1.0));
+    duration<double> warmup(opts.get("warmup", 0.1));
+    unsigned points = opts.get("points", 101.0);
+    unsigned long file_size = opts.get("file-size", double(1ul << 30));
+    std::string output = opts.get("output", std::string());
+    opts.check();
+
+    if (points < 2) {
+        throw std::runtime_error("need at least 2 points");
+    }
+
+    bool write = ops.find("write") != std::string::npos;
+    file_size = prepare_file(path, file_size);
+    auto max_size = *std::max_element(sizes.begin(), sizes.end());
+    if (file_size < max_size) {
+        throw std::runtime_error(fmt::format("{} has {} bytes, less than the request size {}", path, file_size, max_size));
+    }
+    capture cap(path, file_size, *std::max_element(depths.begin(), depths.end()), max_size, write);
+
+    auto out = output.empty() ? nullptr : fopen(output.c_str(), "w");
+    if (!output.empty() && !out) {
+        throw std::runtime_error(fmt::format("cannot open {}: {}", output, strerror(errno)));
+    }
+    FILE* f = out ? out : stdout;
+    fmt::print(f, "{}\n", device_profile::header);
+
+    std::stringstream os(ops);
+    std::string op;
+    while (std::getline(os, op, ',')) {
+        unsigned char opcode;
+        if (op == "read") {
+            opcode = IORING_OP_READ_FIXED;
+        } else if (op == "write") {
+            opcode = IORING_OP_WRITE_FIXED;
+        } else {
+            throw std::runtime_error(fmt::format("unknown op {}", op));
+        }
+
+        for (auto size : sizes) {
+            for (auto depth : depths) {
+                auto hist = cap.run(opcode, size, depth, warmup, time);
+                fmt::print(f, "{} {} {}", op, size, depth);
+                for (unsigned i = 0; i < points; i++) {
+                    fmt::print(f, " {:.1f}", hist.quantile(double(i) / (points - 1)));
+                }
+                fmt::print(f, "\n");
+                fflush(f);
+                fmt::print(stderr, "{} {} depth {}: {:.0f} requests, {:.0f} iops, p50 {:.1f}us p99 {:.1f}us\n", op, size, depth,
+                        hist.total(), hist.total() / time.count(), hist.quantile(0.5), hist.quantile(0.99));
+            }
+        }
+    }
+
+    if (out) {
+        fclose(out);
+    }
+    return 0;
+}
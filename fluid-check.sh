@@ -0,0 +1,36 @@
+#!/bin/sh
+# Runs the reference scenarios with the exact and the fluid engines and
+# prints the relative error of the fluid total latencies
+#
+#   ./fluid-check.sh [duration seconds] [--option=value ...]
+
+SIM=${SIM:-./sim}
+TIME=${1:-5}
+[ $# -gt 0 ] && shift
+
+latencies() {
+    $SIM $TIME "$@" | awk '/^total latencies/ { print $4, $6, $8 }'
+}
+
+printf "%-45s %9s %9s %9s\n" scenario mean p95 p99
+while read -r scenario; do
+    case "$scenario" in ''|'#'*) continue ;; esac
+    exact=$(latencies $scenario "$@")
+    approx=$(latencies $scenario --engine=fluid "$@")
+    echo "$scenario" "$exact" "$approx" | awk '{
+        n = NF - 6
+        name = $1; for (i = 2; i <= n; i++) name = name " " $i
+        printf "%-45s", name
+        for (i = 1; i <= 3; i++) printf " %+8.1f%%", ($(n + 3 + i) - $(n + i)) / $(n + i) * 100
+        printf "\n"
+    }'
+done <<SCENARIOS
+# producer rate dispatcher consumer rate
+poisson 100000 uniform poisson 120000
+poisson 110000 uniform poisson 120000
+poisson 200000 uniform poisson 120000
+uniform 100000 uniform uniform 120000
+capdelay 50000 uniform expdelay 60000
+poisson 2000000 uniform poisson 2400000
+poisson 1000000 poisson uniform 1200000
+SCENARIOS
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Log-linear latency histogram in nanoseconds, buckets are 1/64 of the power
+// of two they belong to, so quantiles are precise to ~1.5%. Samples can be
+// weighted, e.g. by the amount of fluid that saw the latency
+class histogram {
+    static constexpr unsigned sub_bits = 6;
+    static constexpr unsigned sub = 1 << sub_bits;
+
+    std::vector<double> _counts;
+    double _total;
+    double _sum;
+    unsigned long _min;
+    unsigned long _max;
+
+    static unsigned index(unsigned long v) noexcept {
+        if (v < sub) {
+            return v;
+        }
+        unsigned e = 63 - __builtin_clzl(v);
+        return (e - sub_bits + 1) * sub + ((v >> (e - sub_bits)) & (sub - 1));
+    }
+
+    static double value(unsigned idx) noexcept {
+        if (idx < sub) {
+            return idx;
+        }
+        unsigned e = idx / sub + sub_bits - 1;
+        unsigned long width = 1ul << (e - sub_bits);
+        return ((sub + idx % sub) << (e - sub_bits)) + width / 2.0;
+    }
+
+public:
+    histogram() : _counts(index(~0ul) + 1), _total(0.0), _sum(0.0), _min(~0ul), _max(0) {}
+
+    void add(std::chrono::nanoseconds lat, double weight = 1.0) noexcept {
+        unsigned long v = std::max(lat.count(), 0l);
+        _counts[index(v)] += weight;
+        _total += weight;
+        _sum += v * weight;
+        _min = std::min(_min, v);
+        _max = std::max(_max, v);
+    }
+
+    // Latency in usec at probability p
+    double quantile(double p) const noexcept {
+        if (_total == 0.0) {
+            return 0.0;
+        }
+        if (p <= 0.0) {
+            return _min / 1000.0;
+        }
+        if (p >= 1.0) {
+            return _max / 1000.0;
+        }
+        double rank = p * _total;
+        double seen = 0.0;
+        for (unsigned i = 0; i < _counts.size(); i++) {
+            seen += _counts[i];
+            if (seen > rank) {
+                return std::clamp<double>(value(i), _min, _max) / 1000.0;
+            }
+        }
+        return _max / 1000.0;
+    }
+
+    double mean() const noexcept { return _total > 0.0 ? _sum / _total / 1000.0 : 0.0; }
+    double max() const noexcept { return _max / 1000.0; }
+    double total() const noexcept { return _total; }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <fmt/core.h>
+#include <map>
+#include <set>
+#include <string>
+#include <stdexcept>
+
+// Optional knobs follow the positional arguments as --name=value
+class options {
+    std::map<std::string, std::string> _values;
+    mutable std::set<std::string> _used;
+
+public:
+    options(int argc, char **argv, int first) {
+        for (int i = first; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--", 0) != 0) {
+                continue;
+            }
+            auto eq = arg.find('=');
+            if (eq == std::string::npos) {
+                _values[arg.substr(2)] = "";
+            } else {
+                _values[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+            }
+        }
+    }
+
+    bool has(const std::string& name) const {
+        _used.insert(name);
+        return _values.contains(name);
+    }
+
+    std::string get(const std::string& name, std::string def) const {
+        _used.insert(name);
+        auto it = _values.find(name);
+        return it == _values.end() ? def : it->second;
+    }
+
+    double get(const std::string& name, double def) const {
+        _used.insert(name);
+        auto it = _values.find(name);
+        return it == _values.end() ? def : std::stod(it->second);
+    }
+
+    void check() const {
+        for (auto& [name, value] : _values) {
+            if (!_used.contains(name)) {
+                throw std::runtime_error(fmt::format("unknown option --{}", name));
+            }
+        }
+    }
+};
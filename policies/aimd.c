@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include "../policy.h"
+
+// Adaptive limit. Grows by one for every limit worth of completions that
+// executed within the latency goal times goal factor and shrinks by a
+// quarter when a completion took longer than that, at most once per latency
+// goal and never below one request. --policy-args can
+// set the initial limit, otherwise the built-in one is used
+
+struct aimd {
+    double goal;
+    double max_latency;
+    double limit;
+    double decreased;
+};
+
+static void* aimd_create(const struct qd_policy_env* env) {
+    struct aimd* a = malloc(sizeof(*a));
+    a->goal = env->latency_goal;
+    a->max_latency = env->latency_goal * env->goal_factor;
+    a->decreased = 0.0;
+    a->limit = env->args[0] ? atof(env->args) : env->limit;
+    if (a->limit < 1.0) {
+        a->limit = 1.0;
+    }
+    return a;
+}
+
+static void aimd_destroy(void* p) {
+    free(p);
+}
+
+static unsigned long aimd_tick(void* p, double now, unsigned long queued, unsigned long executing) {
+    struct aimd* a = p;
+    unsigned long limit = a->limit;
+    return executing >= limit ? 0 : limit - executing;
+}
+
+static void aimd_complete(void* p, double now, double latency, double exec_latency) {
+    struct aimd* a = p;
+    if (exec_latency > a->max_latency) {
+        if (now - a->decreased >= a->goal) {
+            a->limit = a->limit * 0.75 > 1.0 ? a->limit * 0.75 : 1.0;
+            a->decreased = now;
+        }
+    } else {
+        a->limit += 1.0 / a->limit;
+    }
+}
+
+static const struct qd_policy_ops ops = {
+    .abi = QD_POLICY_ABI,
+    .create = aimd_create,
+    .destroy = aimd_destroy,
+    .queue = NULL,
+    .tick = aimd_tick,
+    .complete = aimd_complete,
+};
+
+const struct qd_policy_ops* qd_policy(void) {
+    return &ops;
+}
@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include "../policy.h"
+
+// Same as the built-in dispatcher, keeps at most limit requests executing.
+// Comparing it with the built-in one measures the plugin boundary overhead
+
+struct limit {
+    unsigned long limit;
+};
+
+static void* limit_create(const struct qd_policy_env* env) {
+    struct limit* l = malloc(sizeof(*l));
+    l->limit = env->limit;
+    return l;
+}
+
+static void limit_destroy(void* p) {
+    free(p);
+}
+
+static unsigned long limit_tick(void* p, double now, unsigned long queued, unsigned long executing) {
+    struct limit* l = p;
+    return executing >= l->limit ? 0 : l->limit - executing;
+}
+
+static const struct qd_policy_ops ops = {
+    .abi = QD_POLICY_ABI,
+    .create = limit_create,
+    .destroy = limit_destroy,
+    .queue = NULL,
+    .tick = limit_tick,
+    .complete = NULL,
+};
+
+const struct qd_policy_ops* qd_policy(void) {
+    return &ops;
+}
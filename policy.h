@@ -0,0 +1,38 @@
+#pragma once
+
+// Dispatcher policy plugin ABI. A policy is a shared object exporting
+// qd_policy() that returns the table below. Times are in seconds since the
+// start of the run, every event costs exactly one indirect call and NULL
+// callbacks are not called at all.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QD_POLICY_ABI 1
+
+struct qd_policy_env {
+    double latency_goal;     // dispatcher latency goal
+    double goal_factor;
+    double consumer_latency; // 1 / consumer rate
+    unsigned long limit;     // the built-in dispatcher's limit
+    const char* args;        // --policy-args, never NULL
+};
+
+struct qd_policy_ops {
+    unsigned abi; // QD_POLICY_ABI
+    void* (*create)(const struct qd_policy_env* env);
+    void (*destroy)(void* p);
+    // A request was queued to the dispatcher
+    void (*queue)(void* p, double now);
+    // Dispatcher polls, returns how many queued requests to dispatch now
+    unsigned long (*tick)(void* p, double now, unsigned long queued, unsigned long executing);
+    // A dispatched request was reaped, latencies are total and execution ones
+    void (*complete)(void* p, double now, double latency, double exec_latency);
+};
+
+const struct qd_policy_ops* qd_policy(void);
+
+#ifdef __cplusplus
+}
+#endif
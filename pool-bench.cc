@@ -0,0 +1,158 @@
+#include <fmt/core.h>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <new>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "options.hh"
+#include "pool.hh"
+
+using namespace std::chrono;
+
+// Counts heap allocations made by the measured code
+static unsigned long allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Hardware cache misses of this thread, if the kernel lets us count them
+class miss_counter {
+    int _fd;
+
+public:
+    miss_counter() {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~miss_counter() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    void start() {
+        if (_fd >= 0) {
+            ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    std::string stop() {
+        if (_fd < 0) {
+            return "n/a";
+        }
+        ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+        long long count = 0;
+        if (read(_fd, &count, sizeof(count)) != sizeof(count)) {
+            return "n/a";
+        }
+        return fmt::format("{}", count);
+    }
+};
+
+// The layout requests had before the pool, one list node each
+struct node_request {
+    const duration<double> start;
+    duration<double> dispatch;
+    duration<double> complete;
+    void* const wait;
+    const unsigned long key;
+    node_request(duration<double> now) : start(now), dispatch(0), complete(0), wait(nullptr), key(0) {}
+};
+
+struct node_queue {
+    std::list<node_request> q;
+
+    void push(duration<double> now) { q.emplace_back(now); }
+
+    duration<double> pop(duration<double> now) {
+        auto& rq = q.front();
+        rq.dispatch = now;
+        auto lat = now - rq.start;
+        q.pop_front();
+        return lat;
+    }
+};
+
+struct pooled_queue {
+    request_pool pool;
+    std::deque<request_pool::handle> q;
+
+    void push(duration<double> now) { q.push_back(pool.alloc(now)); }
+
+    duration<double> pop(duration<double> now) {
+        auto rq = q.front();
+        q.pop_front();
+        pool.dispatch(rq) = now;
+        auto lat = now - pool.start(rq);
+        pool.release(rq);
+        return lat;
+    }
+};
+
+// Builds a backlog of the given size, then keeps it at that size for the
+// given number of rounds, each dispatching one request and queueing one
+template <typename Queue>
+static void run(const char* name, unsigned long backlog, unsigned long rounds) {
+    miss_counter misses;
+    Queue queue;
+    duration<double> now(0.0);
+    duration<double> total(0.0);
+    auto tick = duration<double>(1e-6);
+
+    auto allocs = allocations;
+    auto start = steady_clock::now();
+    misses.start();
+    for (unsigned long i = 0; i < backlog; i++) {
+        queue.push(now);
+        now += tick;
+    }
+    for (unsigned long i = 0; i < rounds; i++) {
+        total += queue.pop(now);
+        queue.push(now);
+        now += tick;
+    }
+    for (unsigned long i = 0; i < backlog; i++) {
+        total += queue.pop(now);
+    }
+    auto missed = misses.stop();
+    duration<double> took = steady_clock::now() - start;
+    unsigned long ops = 2 * (backlog + rounds);
+
+    fmt::print("{:<7} backlog {:<10} {:8.1f} ns/op  allocations {:<10} cache misses {:<12} (mean latency {:.3f})\n", name, backlog,
+            took.count() * 1e9 / ops, allocations - allocs, missed, total.count() / (backlog + rounds));
+}
+
+int main(int argc, char **argv)
+{
+    options opts(argc, argv, 1);
+    std::stringstream ss(opts.get("backlogs", std::string("10000,1000000,10000000")));
+    unsigned long rounds = opts.get("rounds", 10000000.0);
+    opts.check();
+
+    for (std::string item; std::getline(ss, item, ',');) {
+        unsigned long backlog = std::stoul(item);
+        run<node_queue>("list", backlog, rounds);
+        run<pooled_queue>("pool", backlog, rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct waiter;
+
+// Requests live in columns indexed by 32-bit handles, queues move handles
+// and every loop touches only the columns it needs. Columns are split in
+// chunks so growing the pool never copies requests, and released handles
+// are reused, so the pool only grows to the peak number of live requests
+class request_pool {
+public:
+    using handle = uint32_t;
+    static constexpr handle none = ~handle(0);
+
+private:
+    static constexpr unsigned chunk_bits = 16;
+    static constexpr handle chunk_size = handle(1) << chunk_bits;
+
+    struct chunk {
+        std::chrono::duration<double> start[chunk_size];
+        std::chrono::duration<double> dispatch[chunk_size];
+        std::chrono::duration<double> complete[chunk_size];
+        uint64_t seq[chunk_size];
+        waiter* wait[chunk_size];
+    };
+
+    std::vector<std::unique_ptr<chunk>> _chunks;
+    std::vector<handle> _free;
+    handle _used = 0;
+    unsigned long _allocs = 0;
+    uint64_t _arrivals = 0;
+
+    chunk& at(handle h) const noexcept { return *_chunks[h >> chunk_bits]; }
+    static handle idx(handle h) noexcept { return h & (chunk_size - 1); }
+
+public:
+    // Every arrival is numbered, whether it is pooled right away or not, so
+    // the numbers tell requests apart while handles are reused
+    uint64_t next_seq() noexcept { return _arrivals++; }
+
+    handle alloc(std::chrono::duration<double> now, waiter* w = nullptr) {
+        return alloc(now, next_seq(), w);
+    }
+
+    // Pools a request that was numbered when it arrived
+    handle alloc(std::chrono::duration<double> now, uint64_t seq, waiter* w = nullptr) {
+        _allocs++;
+        handle h;
+        if (!_free.empty()) {
+            h = _free.back();
+            _free.pop_back();
+        } else {
+            if (_used == _chunks.size() * chunk_size) {
+                _chunks.push_back(std::make_unique<chunk>());
+            }
+            h = _used++;
+        }
+        at(h).start[idx(h)] = now;
+        at(h).seq[idx(h)] = seq;
+        at(h).wait[idx(h)] = w;
+        return h;
+    }
+
+    void release(handle h) { _free.push_back(h); }
+
+    std::chrono::duration<double> start(handle h) const noexcept { return at(h).start[idx(h)]; }
+    std::chrono::duration<double>& dispatch(handle h) noexcept { return at(h).dispatch[idx(h)]; }
+    std::chrono::duration<double>& complete(handle h) noexcept { return at(h).complete[idx(h)]; }
+    uint64_t seq(handle h) const noexcept { return at(h).seq[idx(h)]; }
+    waiter* wait(handle h) const noexcept { return at(h).wait[idx(h)]; }
+
+    // Requests handed out, chunks allocated for them and requests alive
+    unsigned long allocs() const noexcept { return _allocs; }
+    unsigned long chunks() const noexcept { return _chunks.size(); }
+    unsigned long live() const noexcept { return _used - _free.size(); }
+    unsigned long memory() const noexcept { return _chunks.size() * sizeof(chunk) + _free.capacity() * sizeof(handle); }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// Device profile is a text file with lines like
+//
+//   <op> <request size> <queue depth> <q_0> <q_1> ... <q_N>
+//
+// where op is read or write, size is in bytes and q_i is the latency in usec
+// at probability i/N, so each line is the latency distribution of a request
+// sent to the device that has <queue depth> requests in flight (including
+// itself). All lines must have the same number of quantiles, lines starting
+// with # are comments.
+class device_profile {
+    struct row {
+        unsigned depth;
+        std::vector<double> quantiles;
+    };
+
+    std::vector<row> _rows; // for the selected op and size, sorted by depth
+    std::vector<std::pair<unsigned, double>> _by_depth; // depth -> row and the weight of the next row
+    unsigned _points = 0;
+
+    double quantile(const row& r, double u) const noexcept {
+        double x = u * (_points - 1);
+        unsigned i = std::min<unsigned>(x, _points - 2);
+        double f = x - i;
+        return r.quantiles[i] + f * (r.quantiles[i + 1] - r.quantiles[i]);
+    }
+
+public:
+    static constexpr const char* header = "# queue-dispatch device profile: op size depth latency quantiles (usec)";
+
+    device_profile(std::istream& in, std::string op, unsigned long size) {
+        struct line {
+            unsigned long size;
+            row r;
+        };
+        std::vector<line> lines;
+        std::string text;
+
+        while (std::getline(in, text)) {
+            if (text.empty() || text[0] == '#') {
+                continue;
+            }
+
+            std::istringstream ls(text);
+            std::string lop;
+            line l;
+            if (!(ls >> lop >> l.size >> l.r.depth) || l.r.depth == 0) {
+                throw std::runtime_error(fmt::format("bad profile line: {}", text));
+            }
+            if (lop != op) {
+                continue;
+            }
+            double q;
+            while (ls >> q) {
+                l.r.quantiles.push_back(q);
+            }
+            if (l.r.quantiles.size() < 2 || (_points != 0 && l.r.quantiles.size() != _points)) {
+                throw std::runtime_error(fmt::format("bad profile quantiles: {}", text));
+            }
+            _points = l.r.quantiles.size();
+            lines.push_back(std::move(l));
+        }
+
+        if (lines.empty()) {
+            throw std::runtime_error(fmt::format("no {} lines in profile", op));
+        }
+
+        // Requests have no size, so the whole run uses the closest measured one
+        unsigned long best = lines.front().size;
+        for (auto& l : lines) {
+            auto dist = [size] (unsigned long s) { return s > size ? s - size : size - s; };
+            if (dist(l.size) < dist(best)) {
+                best = l.size;
+            }
+        }
+        for (auto& l : lines) {
+            if (l.size == best) {
+                _rows.push_back(std::move(l.r));
+            }
+        }
+        std::sort(_rows.begin(), _rows.end(), [] (const row& a, const row& b) { return a.depth < b.depth; });
+
+        // Depths between the measured ones are interpolated linearly, the
+        // table makes this O(1) at sampling time
+        _by_depth.resize(_rows.back().depth + 1);
+        unsigned r = 0;
+        for (unsigned d = 0; d < _by_depth.size(); d++) {
+            while (r + 1 < _rows.size() && _rows[r + 1].depth <= d) {
+                r++;
+            }
+            if (d <= _rows[r].depth || r + 1 == _rows.size()) {
+                _by_depth[d] = { r, 0.0 };
+            } else {
+                _by_depth[d] = { r, double(d - _rows[r].depth) / (_rows[r + 1].depth - _rows[r].depth) };
+            }
+        }
+    }
+
+    static device_profile load(std::string path, std::string op, unsigned long size) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error(fmt::format("cannot open profile {}", path));
+        }
+        return device_profile(in, op, size);
+    }
+
+    // Latency of a request at the given queue depth, u is uniform in [0, 1)
+    std::chrono::duration<double> sample(unsigned depth, double u) const noexcept {
+        auto [r, w] = _by_depth[std::min<unsigned>(depth, _by_depth.size() - 1)];
+        double lat = quantile(_rows[r], u);
+        if (w != 0.0) {
+            lat += w * (quantile(_rows[r + 1], u) - lat);
+        }
+        return std::chrono::duration<double, std::micro>(lat);
+    }
+
+    unsigned max_depth() const noexcept { return _rows.back().depth; }
+};
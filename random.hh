@@ -0,0 +1,93 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3"). A sample is a pure function of the
+// seed, the component drawing it, the component instance, the sample index
+// and an optional sub-stream, so any sample can be computed without the
+// ones before it, batches can be generated in parallel and two runs with the
+// same seed see the same arrivals and service times whatever the dispatcher
+// does in between
+class random_stream {
+    static constexpr uint32_t m0 = 0xD2511F53;
+    static constexpr uint32_t m1 = 0xCD9E8D57;
+    static constexpr uint32_t w0 = 0x9E3779B9;
+    static constexpr uint32_t w1 = 0xBB67AE85;
+    static constexpr unsigned batch = 64;
+
+    uint32_t _k0;
+    uint32_t _k1;
+    uint32_t _component;
+    uint32_t _instance;
+    uint64_t _index; // of the next sequential draw
+    std::array<uint64_t, batch> _buf;
+
+public:
+    static std::array<uint32_t, 4> philox(std::array<uint32_t, 4> c, uint32_t k0, uint32_t k1) noexcept {
+        for (unsigned r = 0; r < 10; r++) {
+            uint64_t p0 = uint64_t(m0) * c[0];
+            uint64_t p1 = uint64_t(m1) * c[2];
+            c = { uint32_t(p1 >> 32) ^ c[1] ^ k0, uint32_t(p1), uint32_t(p0 >> 32) ^ c[3] ^ k1, uint32_t(p0) };
+            k0 += w0;
+            k1 += w1;
+        }
+        return c;
+    }
+
+    random_stream(uint64_t seed, uint32_t component, uint32_t instance = 0)
+            : _k0(seed)
+            , _k1(seed >> 32)
+            , _component(component)
+            , _instance(instance)
+            , _index(0)
+    {
+    }
+
+    // Samples come in pairs, one Philox block gives 128 bits
+    uint64_t bits(uint64_t index, uint32_t sub = 0) const noexcept {
+        uint64_t block = index >> 1;
+        auto r = philox({ uint32_t(block), uint32_t(block >> 32), _component, _instance ^ (sub << 16) }, _k0, _k1);
+        return index & 1 ? (uint64_t(r[3]) << 32 | r[2]) : (uint64_t(r[1]) << 32 | r[0]);
+    }
+
+    // Samples first..first+n-1, first and n are even. There are no
+    // dependencies between the blocks, so the loop vectorizes
+    void fill(uint64_t first, unsigned n, uint64_t* out, uint32_t sub = 0) const noexcept {
+        for (unsigned i = 0; i < n / 2; i++) {
+            uint64_t block = (first >> 1) + i;
+            auto r = philox({ uint32_t(block), uint32_t(block >> 32), _component, _instance ^ (sub << 16) }, _k0, _k1);
+            out[2 * i] = uint64_t(r[1]) << 32 | r[0];
+            out[2 * i + 1] = uint64_t(r[3]) << 32 | r[2];
+        }
+    }
+
+    static double to_unit(uint64_t b) noexcept { return (b >> 11) * 0x1.0p-53; }
+
+    // Uniform in [0, 1)
+    double uniform(uint64_t index, uint32_t sub = 0) const noexcept { return to_unit(bits(index, sub)); }
+
+    // Sequential draws, pre-generated in batches
+    uint64_t next_bits() noexcept {
+        unsigned pos = _index % batch;
+        if (pos == 0) {
+            fill(_index, batch, _buf.data());
+        }
+        _index++;
+        return _buf[pos];
+    }
+
+    double next() noexcept { return to_unit(next_bits()); }
+    double next_exp() noexcept { return -std::log1p(-next()); }
+    // Standard normal, Box-Muller with one of the pair thrown away
+    double next_normal() noexcept {
+        double r = std::sqrt(-2.0 * std::log1p(-next()));
+        return r * std::cos(2.0 * M_PI * next());
+    }
+    // Uniform in [0, n)
+    uint64_t next_below(uint64_t n) noexcept { return below(next_bits(), n); }
+    static uint64_t below(uint64_t b, uint64_t n) noexcept { return (unsigned __int128)b * n >> 64; }
+    uint64_t index() const noexcept { return _index; }
+};
@@ -0,0 +1,49 @@
+#include <fmt/core.h>
+#include <chrono>
+#include <thread>
+#include <signal.h>
+#include "options.hh"
+#include "stats.hh"
+
+using namespace std::chrono;
+
+// Shows the live counters a run publishes with --stats=path. Reading the
+// page never blocks the simulator
+static void show(const stats_values& v, unsigned long pid, bool alive) {
+    fmt::print("pid {}  {}\n", pid, v.done ? "done" : (alive ? "running" : "gone"));
+    fmt::print("simulated {:.3f}s of {:.0f}s ({:.1f}%)  wall {:.1f}s  speed {:.3f}x\n", v.now, v.duration,
+            v.duration > 0 ? v.now * 100.0 / v.duration : 0.0, v.wall, v.wall > 0 ? v.now / v.wall : 0.0);
+    fmt::print("events {:.0f} ({:.0f}/s)\n", v.events, v.wall > 0 ? v.events / v.wall : 0.0);
+    fmt::print("queued {:.0f}  executing {:.0f}  completed {:.0f}\n", v.queued, v.executing, v.completed);
+    fmt::print("rates: arrivals {:.0f}  dispatches {:.0f}  completions {:.0f}\n", v.arrival_rate, v.dispatch_rate, v.completion_rate);
+    fmt::print("total latencies: mean {:.1f}us  p95 {:.1f}us  p99 {:.1f}us  max {:.1f}us\n", v.mean, v.p95, v.p99, v.max);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fmt::print("usage: {} <stats file> [--interval=seconds] [--once]\n", argv[0]);
+        return 1;
+    }
+
+    options opts(argc, argv, 2);
+    duration<double> interval(opts.get("interval", 1.0));
+    bool once = opts.has("once");
+    opts.check();
+
+    stats_reader stats(argv[1]);
+    for (;;) {
+        auto v = stats.read();
+        bool alive = kill(stats.pid(), 0) == 0 || errno == EPERM;
+        if (!once) {
+            fmt::print("\033[H\033[2J");
+        }
+        show(v, stats.pid(), alive);
+        fflush(stdout);
+        if (once || v.done || !alive) {
+            break;
+        }
+        std::this_thread::sleep_for(interval);
+    }
+    return 0;
+}
@@ -1,9 +1,25 @@
 #include <fmt/core.h>
 #include <fmt/ranges.h>
 #include <fmt/chrono.h>
+#include <array>
+#include <bit>
 #include <random>
+#include <cmath>
 #include <chrono>
+#include <deque>
+#include <limits>
 #include <list>
+#include <map>
+#include <numeric>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <coroutine>
+#include <queue>
+#include <unordered_map>
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics/stats.hpp>
 #include <boost/accumulators/statistics/max.hpp>
@@ -11,11 +27,39 @@
 #include <boost/accumulators/statistics/p_square_quantile.hpp>
 #include <boost/accumulators/statistics/extended_p_square.hpp>
 #include <boost/accumulators/statistics/extended_p_square_quantile.hpp>
+#include "options.hh"
+#include "profile.hh"
+#include "uring.hh"
+#include "policy.h"
+#include "pool.hh"
+#include "random.hh"
+#include "histogram.hh"
+#include "stats.hh"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 #ifndef VERB
 #define VERB false
 #endif
 
+#ifndef SELF_PROFILE
+#define SELF_PROFILE true
+#endif
+
 #ifndef CAP_FACTOR
 #define CAP_FACTOR (3.0)
 #endif
@@ -23,6 +67,18 @@
 using namespace std::chrono;
 using namespace boost::accumulators;
 
+// Every user of random numbers draws from its own stream, instances of a
+// component (consumers, shards) have one each
+enum class stream : uint32_t {
+    arrivals, service, pause, think,
+    stall_every, stall_time, degrade_every, degrade_time,
+    keys, routing, stealing, device,
+};
+
+static random_stream make_stream(uint64_t seed, stream s, uint32_t instance = 0) {
+    return random_stream(seed, uint32_t(s), instance);
+}
+
 class process {
 public:
     virtual duration<double> get() = 0;
@@ -30,37 +86,34 @@ public:
 };
 
 class poisson_process : public process {
-    std::random_device _rd;
-    std::mt19937 _rng;
-    std::exponential_distribution<double> _exp;
+    duration<double> _period;
+    random_stream _rs;
 
 public:
-    poisson_process(duration<double> period)
-            : _rng(_rd())
-            , _exp(1.0 / period.count())
+    poisson_process(duration<double> period, random_stream rs)
+            : _period(period)
+            , _rs(rs)
     {
     }
 
     virtual duration<double> get() override {
-        return duration<double>(_exp(_rng));
+        return _period * _rs.next_exp();
     }
 };
 
 class exp_delay_process : public process {
     duration<double> _lat;
-    std::random_device _rd;
-    std::mt19937 _rng;
-    std::exponential_distribution<double> _exp;
+    random_stream _rs;
 
 public:
-    exp_delay_process(duration<double> period)
+    exp_delay_process(duration<double> period, random_stream rs)
             : _lat(period)
-            , _exp(1.0)
+            , _rs(rs)
     {
     }
 
     virtual duration<double> get() override {
-        return _lat * (1.0 + _exp(_rng));
+        return _lat * (1.0 + _rs.next_exp());
     }
 };
 
@@ -80,43 +133,207 @@ public:
 
 class cap_delay_process : public process {
     duration<double> _lat;
-    std::random_device _rd;
-    std::mt19937 _rng;
-    std::uniform_real_distribution<double> _jit;
+    random_stream _rs;
 
 public:
-    cap_delay_process(duration<double> period)
+    cap_delay_process(duration<double> period, random_stream rs)
             : _lat(period)
-            , _jit(1.0, CAP_FACTOR)
+            , _rs(rs)
     {
     }
 
     virtual duration<double> get() override {
-        return _lat * _jit(_rng);
+        return _lat * (1.0 + _rs.next() * (CAP_FACTOR - 1.0));
     }
 };
 
-static std::unique_ptr<process> make_process(std::string proc, duration<double> lat) {
+static std::unique_ptr<process> make_process(std::string proc, duration<double> lat, random_stream rs) {
     if (proc == "uniform") {
         return std::make_unique<uniform_process>(lat);
     }
     if (proc == "poisson") {
-        return std::make_unique<poisson_process>(lat);
+        return std::make_unique<poisson_process>(lat, rs);
     }
     if (proc == "expdelay") {
-        return std::make_unique<exp_delay_process>(lat);
+        return std::make_unique<exp_delay_process>(lat, rs);
     }
     if (proc == "capdelay") {
-        return std::make_unique<cap_delay_process>(lat);
+        return std::make_unique<cap_delay_process>(lat, rs);
     }
 
     throw std::runtime_error(fmt::format("unknown process {}", proc));
 }
 
-struct request {
-    const duration<double> start;
-    duration<double> dispatch;
-    request(duration<double> now) : start(now), dispatch(0) { }
+// Mean interval of the process in its periods and the squared coefficient
+// of variation, what the fluid engine knows about it
+struct process_moments {
+    double mean;
+    double scv;
+};
+
+static process_moments moments(std::string proc) {
+    if (proc == "uniform") {
+        return { 1.0, 0.0 };
+    }
+    if (proc == "poisson") {
+        return { 1.0, 1.0 };
+    }
+    if (proc == "expdelay") {
+        return { 2.0, 0.25 };
+    }
+    if (proc == "capdelay") {
+        double mean = (1.0 + CAP_FACTOR) / 2.0;
+        return { mean, (CAP_FACTOR - 1.0) * (CAP_FACTOR - 1.0) / 12.0 / (mean * mean) };
+    }
+
+    throw std::runtime_error(fmt::format("unknown process {}", proc));
+}
+
+// Request keys are drawn from 0..keys-1, key 0 is the most popular one. The
+// key of the i-th request only depends on i
+class key_generator {
+public:
+    virtual unsigned long get() = 0;
+    virtual ~key_generator() = default;
+};
+
+class uniform_keys : public key_generator {
+    random_stream _rs;
+    const unsigned long _keys;
+
+public:
+    uniform_keys(unsigned long keys, random_stream rs) : _rs(rs), _keys(keys) {}
+
+    virtual unsigned long get() override {
+        return _rs.next_below(_keys);
+    }
+};
+
+// Zipf distribution sampled with rejection-inversion (Hoermann and Derflinger),
+// expected O(1) time and no tables, so key spaces can be arbitrarily large
+class zipf_keys : public key_generator {
+    random_stream _rs;
+    unsigned long _i;
+    const double _s;
+    const double _n;
+    double _h_x1;
+    double _h_n;
+    double _sv;
+
+    static double helper1(double x) noexcept {
+        return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+    }
+
+    static double helper2(double x) noexcept {
+        return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x));
+    }
+
+    double h(double x) const noexcept {
+        return std::exp(-_s * std::log(x));
+    }
+
+    double h_integral(double x) const noexcept {
+        double lx = std::log(x);
+        return helper2((1.0 - _s) * lx) * lx;
+    }
+
+    double h_integral_inverse(double x) const noexcept {
+        double t = std::max(x * (1.0 - _s), -1.0);
+        return std::exp(helper1(t) * x);
+    }
+
+public:
+    zipf_keys(unsigned long keys, double s, random_stream rs)
+            : _rs(rs)
+            , _i(0)
+            , _s(s)
+            , _n(keys)
+    {
+        if (s <= 0.0) {
+            throw std::runtime_error("zipf exponent must be positive");
+        }
+        _h_x1 = h_integral(1.5) - 1.0;
+        _h_n = h_integral(_n + 0.5);
+        _sv = 2.0 - h_integral_inverse(h_integral(2.5) - h(2.0));
+    }
+
+    // Rejected attempts draw from the sub-streams of the request
+    virtual unsigned long get() override {
+        unsigned long i = _i++;
+        for (uint32_t attempt = 0;; attempt++) {
+            double u = _h_n + _rs.uniform(i, attempt) * (_h_x1 - _h_n);
+            double x = h_integral_inverse(u);
+            double k = std::clamp(std::floor(x + 0.5), 1.0, _n);
+            if (k - x <= _sv || u >= h_integral(k + 0.5) - h(k)) {
+                return k - 1;
+            }
+        }
+    }
+};
+
+// The hot fraction of keys gets the hot share of requests
+class hotspot_keys : public key_generator {
+    random_stream _rs;
+    unsigned long _i;
+    const double _hot_share;
+    const unsigned long _hot; // number of hot keys
+    const unsigned long _cold; // the first cold one
+    const unsigned long _keys;
+
+public:
+    hotspot_keys(unsigned long keys, double hot_keys, double hot_share, random_stream rs)
+            : _rs(rs)
+            , _i(0)
+            , _hot_share(hot_share)
+            , _hot(std::max(1ul, (unsigned long)(keys * hot_keys)))
+            , _cold(std::min(keys - 1, _hot))
+            , _keys(keys)
+    {
+    }
+
+    virtual unsigned long get() override {
+        unsigned long i = _i++;
+        unsigned long bits = _rs.bits(i, 1);
+        if (_rs.uniform(i) < _hot_share) {
+            return random_stream::below(bits, _hot);
+        }
+        return _cold + random_stream::below(bits, _keys - _cold);
+    }
+};
+
+// Hotspot is given as <fraction of keys>:<share of requests>
+static std::unique_ptr<key_generator> make_keys(std::string dist, unsigned long keys, double zipf, std::string hotspot, random_stream rs) {
+    if (keys == 0) {
+        throw std::runtime_error("empty key space");
+    }
+    if (dist == "uniform") {
+        return std::make_unique<uniform_keys>(keys, rs);
+    }
+    if (dist == "zipf") {
+        return std::make_unique<zipf_keys>(keys, zipf, rs);
+    }
+    if (dist == "hotspot") {
+        auto colon = hotspot.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error(fmt::format("bad hotspot {}", hotspot));
+        }
+        return std::make_unique<hotspot_keys>(keys, std::stod(hotspot.substr(0, colon)), std::stod(hotspot.substr(colon + 1)), rs);
+    }
+
+    throw std::runtime_error(fmt::format("unknown key distribution {}", dist));
+}
+
+// Scripted client waiting for its request to complete
+struct waiter {
+    std::coroutine_handle<> handle;
+    duration<double>* clock; // the script engine's time, set on wakeup
+    duration<double> latency;
+
+    void wake(duration<double> now, duration<double> lat) {
+        *clock = now;
+        latency = lat;
+        handle.resume();
+    }
 };
 
 class collector {
@@ -124,19 +341,29 @@ class collector {
     using accumulator_type = accumulator_set<double, stats<tag::extended_p_square_quantile(quadratic), tag::mean, tag::max>>;
     accumulator_type _latencies;
     accumulator_type _x_latencies;
+    collector* _parent; // per-consumer collectors also feed the total one
+    unsigned long _count;
 
 public:
-    collector()
+    collector(collector* parent = nullptr)
             : _latencies(extended_p_square_probabilities = quantiles)
             , _x_latencies(extended_p_square_probabilities = quantiles)
+            , _parent(parent)
+            , _count(0)
     {
     }
 
     void collect(duration<double> lat, duration<double> xlat) {
         _latencies(lat.count());
         _x_latencies(xlat.count());
+        _count++;
+        if (_parent) {
+            _parent->collect(lat, xlat);
+        }
     }
 
+    unsigned long count() const noexcept { return _count; }
+
     duration<double> max_lat() const noexcept {
         return duration<double>(max(_latencies));
     }
@@ -170,176 +397,3737 @@ public:
     }
 };
 
-class consumer {
-    std::list<request> _executing;
-    duration<double> _next;
-    unsigned long _processed;
-    collector& _st;
-    const duration<double> _lat;
-    std::unique_ptr<process> _pause;
+// Policies are looked up in ./policies unless given by path
+static std::string policy_path(std::string name) {
+    return name.find('/') == std::string::npos ? fmt::format("./policies/{}.so", name) : name;
+}
+
+// Dispatcher policy loaded from a shared object, see policy.h
+class policy {
+    void* _dl;
+    const qd_policy_ops* _ops;
+    void* _p;
 
 public:
-    consumer(unsigned rps, collector& st, std::string proc)
-            : _processed(0)
-            , _st(st)
-            , _lat(1.0 / rps)
-            , _pause(make_process(proc, _lat))
-    {
+    policy(std::string name, const qd_policy_env& env) {
+        std::string path = policy_path(name);
+        _dl = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!_dl) {
+            throw std::runtime_error(fmt::format("cannot load policy {}: {}", path, dlerror()));
+        }
+        auto get = reinterpret_cast<const qd_policy_ops* (*)()>(dlsym(_dl, "qd_policy"));
+        _ops = get ? get() : nullptr;
+        if (!_ops || _ops->abi != QD_POLICY_ABI || !_ops->tick) {
+            dlclose(_dl);
+            throw std::runtime_error(fmt::format("{} is not a policy", path));
+        }
+        _p = _ops->create ? _ops->create(&env) : nullptr;
     }
 
-    void tick(duration<double> now) {
-        while (!_executing.empty() > 0 && now >= _next) {
-            _st.collect(now - _executing.front().start, now - _executing.front().dispatch);
-            _executing.pop_front();
-            _processed++;
-            _next += _pause->get();
+    policy(const policy&) = delete;
+
+    ~policy() {
+        if (_ops->destroy) {
+            _ops->destroy(_p);
         }
+        dlclose(_dl);
     }
 
-    void execute(duration<double> now, request rq) {
-        if (_executing.empty()) {
-            _next = now + _pause->get();
+    void queue(duration<double> now) {
+        if (_ops->queue) {
+            _ops->queue(_p, now.count());
         }
-        rq.dispatch = now;
-        _executing.push_back(std::move(rq));
     }
 
-    duration<double> latency() const noexcept { return _lat; }
-    unsigned long executing() const noexcept { return _executing.size(); }
-    unsigned long processed() const noexcept { return _processed; }
+    unsigned long tick(duration<double> now, unsigned long queued, unsigned long executing) {
+        return _ops->tick(_p, now.count(), queued, executing);
+    }
+
+    void complete(duration<double> now, duration<double> start, duration<double> dispatch) {
+        if (_ops->complete) {
+            _ops->complete(_p, now.count(), (now - start).count(), (now - dispatch).count());
+        }
+    }
 };
 
-class dispatcher {
-    std::unique_ptr<process> _pause;
-    duration<double> _next;
-    consumer& _cons;
-    std::list<request> _queue;
-    unsigned long _dispatched;
-    const unsigned long _limit;
+// Flight recorder, the last events of the run kept in a ring and dumped to
+// a file when a request takes longer than the latency trigger or a queue
+// grows beyond the queue trigger. Recording is a store into the ring, cheap
+// enough to leave on. After a dump the triggers are off until the ring has
+// been refilled, so dumps never overlap
+class flight_recorder {
+public:
+    enum kind : uint8_t { arrive, dispatch, complete, limit, poll };
+    static constexpr uint64_t no_request = ~uint64_t(0);
+
+private:
+    // Requests are told by their arrival numbers, handles are reused
+    struct event {
+        double time;
+        uint64_t seq;
+        uint32_t value; // queued, executing, latency in usec or dispatched
+        uint16_t shard;
+        kind what;
+    };
+
+    std::vector<event> _ring;
+    const unsigned long _mask;
+    unsigned long _next = 0;
+    unsigned long _armed = 0; // at this event
+    const duration<double> _latency;
+    const unsigned long _queued;
+    const std::string _path;
+    unsigned _dumps_left;
+    unsigned _dumps = 0;
+
+    // Checked before the reason is formatted, the triggers fire often
+    bool armed() const noexcept { return _next >= _armed && _dumps_left > 0; }
+
+    void trigger(duration<double> now, std::string reason) {
+        auto path = fmt::format("{}.{}", _path, _dumps++);
+        auto f = fopen(path.c_str(), "w");
+        if (!f) {
+            throw std::runtime_error(fmt::format("cannot open {}: {}", path, strerror(errno)));
+        }
+        fmt::print(f, "# {} at {:.6f}\n", reason, now.count());
+        static const char* names[] = { "arrive", "dispatch", "complete", "limit", "poll" };
+        static const char* values[] = { "queued", "executing", "latency", "executing", "dispatched" };
+        for (auto i = _next - std::min(_next, _ring.size()); i < _next; i++) {
+            auto& ev = _ring[i & _mask];
+            fmt::print(f, "{:.6f} {:<8} shard {:<4} ", ev.time, names[ev.what], ev.shard);
+            if (ev.seq != no_request) {
+                fmt::print(f, "request {:<8} ", ev.seq);
+            }
+            fmt::print(f, "{} {}{}\n", values[ev.what], ev.value, ev.what == complete ? "us" : "");
+        }
+        fclose(f);
+        fmt::print(stderr, "flight recorder: {} at {:.6f}, dumped to {}\n", reason, now.count(), path);
+        _dumps_left--;
+        _armed = _next + _ring.size();
+    }
 
 public:
-    dispatcher(duration<double> lat, consumer& c, std::string proc, float goal_factor)
-            : _pause(make_process(proc, lat))
-            , _next(0.0)
-            , _dispatched(0)
-            , _cons(c)
-            , _limit(lat * goal_factor / _cons.latency())
+    // Events are rounded up to a power of two
+    flight_recorder(unsigned long events, duration<double> latency, unsigned long queued, std::string path, unsigned dumps)
+            : _ring(std::bit_ceil(std::max(events, 1ul)))
+            , _mask(_ring.size() - 1)
+            , _latency(latency)
+            , _queued(queued)
+            , _path(std::move(path))
+            , _dumps_left(dumps)
     {
-#if VERB
-        fmt::print("Consumer limit {} requests, goal {}ms factor {}\n", _limit, lat.count() * 1000, goal_factor);
-#endif
-        if (_limit == 0) {
-            throw std::runtime_error("Too low consumer rate");
+    }
+
+    void record(duration<double> now, kind what, unsigned shard, uint64_t seq, unsigned long value) noexcept {
+        _ring[_next++ & _mask] = event{ now.count(), seq, uint32_t(std::min(value, 0xfffffffful)), uint16_t(shard), what };
+    }
+
+    void arrived(duration<double> now, unsigned shard, uint64_t seq, unsigned long queued) {
+        record(now, arrive, shard, seq, queued);
+        if (_queued > 0 && queued > _queued && armed()) {
+            trigger(now, fmt::format("shard {} queued {} requests", shard, queued));
         }
     }
 
-    void queue(duration<double> now) {
-        _queue.emplace_back(now);
+    void completed(duration<double> now, unsigned shard, uint64_t seq, duration<double> lat) {
+        record(now, complete, shard, seq, std::lround(lat.count() * 1e6));
+        if (_latency.count() > 0.0 && lat > _latency && armed()) {
+            trigger(now, fmt::format("shard {} request {} took {:.1f}us", shard, seq, lat.count() * 1e6));
+        }
     }
 
-    void tick(duration<double> now) {
-        if (now >= _next) {
-            _next += _pause->get();
+    unsigned long events() const noexcept { return _next; }
+    unsigned dumps() const noexcept { return _dumps; }
+};
 
-            while (!_queue.empty()) {
-                if (_cons.executing() >= _limit) {
-                    break;
-                }
+// What the dispatcher needs from whoever executes the requests
+class executor {
+protected:
+    request_pool& _pool;
+    policy* _policy = nullptr;
+    flight_recorder* _rec = nullptr;
+    unsigned _shard = 0;
 
-                _cons.execute(now, _queue.front());
-                _queue.pop_front();
-                _dispatched++;
-            }
-        }
+public:
+    explicit executor(request_pool& pool) : _pool(pool) {}
+    virtual void execute(duration<double> now, request_pool::handle rq) = 0;
+    // Notices completed requests, releasing their slots
+    virtual void reap(duration<double> now) = 0;
+    // Sends the requests executed so far
+    virtual void flush() {}
+    // Time the interrupt about the oldest unreaped completion fires
+    virtual duration<double> wakeup() const noexcept { return duration<double>::max(); }
+    virtual duration<double> latency() const noexcept = 0;
+    virtual unsigned long executing() const noexcept = 0;
+    virtual ~executor() = default;
+
+    // Reaped requests are reported to the policy
+    void set_policy(policy* p) noexcept { _policy = p; }
+    // and recorded
+    void set_recorder(flight_recorder* rec, unsigned shard) noexcept {
+        _rec = rec;
+        _shard = shard;
     }
 
-    unsigned long queued() const noexcept { return _queue.size(); }
-    unsigned long dispatched() const noexcept { return _dispatched; }
+protected:
+    // Reports the reaped request to the policy, wakes up its client and
+    // releases it
+    void notify(duration<double> now, request_pool::handle rq) {
+        if (_policy) {
+            _policy->complete(now, _pool.start(rq), _pool.dispatch(rq));
+        }
+        if (_rec) {
+            _rec->completed(now, _shard, _pool.seq(rq), now - _pool.start(rq));
+        }
+        if (auto w = _pool.wait(rq)) {
+            w->wake(now, now - _pool.start(rq));
+        }
+        _pool.release(rq);
+    }
 };
 
-class producer {
-    dispatcher& _disp;
-    duration<double> _next;
-    unsigned long _generated;
-    std::unique_ptr<process> _pause;
+// When the completed requests are noticed by the dispatcher
+//  instant   -- right at the completion, the old model
+//  poll      -- on the next dispatcher poll
+//  interrupt -- on the next poll or after the wakeup latency, whichever comes first
+enum class reaping { instant, poll, interrupt };
+
+static reaping parse_reaping(std::string mode) {
+    if (mode == "instant") {
+        return reaping::instant;
+    }
+    if (mode == "poll") {
+        return reaping::poll;
+    }
+    if (mode == "interrupt") {
+        return reaping::interrupt;
+    }
+
+    throw std::runtime_error(fmt::format("unknown completion mode {}", mode));
+}
 
+// Device service modulation. The device switches between normal, degraded
+// and stalled states staying in each for a time drawn from the dwell process,
+// and scheduled faults slow it down (or stall it) on top of that. The result
+// is the device speed, 1.0 is normal and 0.0 is stalled
+class modulator {
 public:
-    producer(unsigned rps, dispatcher& d, std::string proc)
-            : _pause(make_process(proc, duration<double>(1.0 / rps)))
-            , _disp(d)
-            , _next(0.0)
-            , _generated(0)
+    struct fault {
+        duration<double> at;
+        duration<double> length;
+        double speed;
+    };
+
+private:
+    enum class state { normal, degraded, stalled };
+
+    std::unique_ptr<process> _to_stall;
+    std::unique_ptr<process> _to_degrade;
+    std::unique_ptr<process> _stall;
+    std::unique_ptr<process> _degrade;
+    double _degraded_speed;
+    state _state;
+    state _next_state;
+    duration<double> _until;
+    std::vector<fault> _faults;
+
+    // Normal state lasts until the next stall or degradation, whichever comes first
+    void enter_normal(duration<double> at) {
+        auto to_stall = _to_stall ? _to_stall->get() : duration<double>::max();
+        auto to_degrade = _to_degrade ? _to_degrade->get() : duration<double>::max();
+
+        _state = state::normal;
+        if (to_stall == duration<double>::max() && to_degrade == duration<double>::max()) {
+            _until = duration<double>::max();
+        } else if (to_stall <= to_degrade) {
+            _next_state = state::stalled;
+            _until = at + to_stall;
+        } else {
+            _next_state = state::degraded;
+            _until = at + to_degrade;
+        }
+    }
+
+public:
+    modulator()
+            : _degraded_speed(1.0)
+            , _state(state::normal)
+            , _next_state(state::normal)
+            , _until(duration<double>::max())
+    {
+    }
+
+    modulator(std::string dwell, duration<double> stall_every, duration<double> stall_time,
+            duration<double> degrade_every, duration<double> degrade_time, double degrade_factor,
+            std::vector<fault> faults, uint64_t seed, uint32_t instance)
+            : _degraded_speed(1.0 / degrade_factor)
+            , _state(state::normal)
+            , _next_state(state::normal)
+            , _faults(std::move(faults))
     {
+        if (stall_every.count() > 0.0) {
+            _to_stall = make_process(dwell, stall_every, make_stream(seed, stream::stall_every, instance));
+            _stall = make_process(dwell, stall_time, make_stream(seed, stream::stall_time, instance));
+        }
+        if (degrade_every.count() > 0.0) {
+            _to_degrade = make_process(dwell, degrade_every, make_stream(seed, stream::degrade_every, instance));
+            _degrade = make_process(dwell, degrade_time, make_stream(seed, stream::degrade_time, instance));
+        }
+        enter_normal(duration<double>(0.0));
     }
 
     void tick(duration<double> now) {
-        while (now >= _next) {
-            _next += _pause->get();
-            _disp.queue(now);
-            _generated++;
+        while (now >= _until) {
+            if (_state == state::normal) {
+                _state = _next_state;
+                _until += (_state == state::stalled ? _stall : _degrade)->get();
+            } else {
+                enter_normal(_until);
+            }
         }
     }
 
-    unsigned long generated() const noexcept { return _generated; }
+    double speed(duration<double> now) const noexcept {
+        double speed = _state == state::normal ? 1.0 : (_state == state::degraded ? _degraded_speed : 0.0);
+        for (auto& f : _faults) {
+            if (now >= f.at && now < f.at + f.length) {
+                speed *= f.speed;
+            }
+        }
+        return speed;
+    }
 };
 
+// Faults are given as comma-separated at:for[:slowdown] triplets, times are
+// in seconds, missing slowdown means the device stalls
+static std::vector<modulator::fault> parse_faults(std::string spec) {
+    std::vector<modulator::fault> faults;
+    std::stringstream fs(spec);
+    std::string item;
 
-int main (int argc, char **argv)
-{
-    if (argc < 7) {
-        fmt::print("usage: {} <duration seconds> <producer process> <producer rate> <dispatcher process> <consumer process> <consumer rate> [<latency_goal>] [<goal_factor>]\n", argv[0]);
-        return 1;
+    while (std::getline(fs, item, ',')) {
+        std::vector<std::string> parts;
+        std::stringstream is(item);
+        std::string part;
+        while (std::getline(is, part, ':')) {
+            parts.push_back(part);
+        }
+        if (parts.size() < 2 || parts.size() > 3) {
+            throw std::runtime_error(fmt::format("bad fault {}", item));
+        }
+        double slowdown = parts.size() == 3 ? std::stod(parts[2]) : 0.0;
+        if (parts.size() == 3 && slowdown < 1.0) {
+            throw std::runtime_error(fmt::format("bad fault slowdown {}", item));
+        }
+        faults.push_back(modulator::fault{
+            duration<double>(std::stod(parts[0])),
+            duration<double>(std::stod(parts[1])),
+            slowdown == 0.0 ? 0.0 : 1.0 / slowdown,
+        });
     }
 
-    unsigned long total_sec = atoi(argv[1]);
-    std::string prod_proc = argv[2];
-    unsigned long prod_rate = atoi(argv[3]);
-    std::string disp_proc = argv[4];
-    std::string cons_proc = argv[5];
-    unsigned long cons_rate = atoi(argv[6]);
+    return faults;
+}
 
-    unsigned latency_goal = 500; // as in seastar
-    if (argc > 7 && argv[7][0] != '-') {
-        latency_goal = atoi(argv[7]);
+// Real device behind io_uring, every request is an O_DIRECT read of a random
+// block of the file. Reads are prepared on execute and sent to the kernel in
+// one batch when the dispatcher finishes polling
+class uring_device {
+    struct io {
+        request_pool::handle rq;
+        void* buf;
+    };
+
+    uring _ring;
+    int _fd;
+    const unsigned long _size;
+    unsigned long _blocks;
+    random_stream _rs;
+    std::vector<void*> _free;
+    std::map<unsigned long, io> _inflight;
+    unsigned long _id;
+
+public:
+    uring_device(std::string path, unsigned long size, random_stream rs)
+            : _ring(1024)
+            , _size(size)
+            , _rs(rs)
+            , _id(0)
+    {
+        _fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+        if (_fd < 0) {
+            throw std::runtime_error(fmt::format("cannot open {}: {}", path, strerror(errno)));
+        }
+
+        struct stat st;
+        fstat(_fd, &st);
+        unsigned long fsize = st.st_size;
+        if (S_ISBLK(st.st_mode)) {
+            ioctl(_fd, BLKGETSIZE64, &fsize);
+        }
+        _blocks = fsize / size;
+        if (_blocks == 0) {
+            close(_fd);
+            throw std::runtime_error(fmt::format("{} is too small", path));
+        }
     }
-    float goal_factor = 1.5; // as in seastar
-    if (argc > 8 && argv[8][0] != '-') {
-        goal_factor = atof(argv[8]);
+
+    ~uring_device() {
+        // The kernel still DMAs into the buffers of the reads in flight,
+        // so they can only be freed once their completions are reaped
+        try {
+            while (!_inflight.empty()) {
+                _ring.submit(1);
+                _ring.reap([this] (unsigned long id, int) {
+                    auto it = _inflight.find(id);
+                    _free.push_back(it->second.buf);
+                    _inflight.erase(it);
+                });
+            }
+        } catch (...) {
+            // Leak the buffers of the reads that can't be waited for,
+            // the kernel may write into them after the ring is gone
+        }
+        for (auto b : _free) {
+            free(b);
+        }
+        close(_fd);
     }
 
-    collector st;
-    consumer cons(cons_rate, st, cons_proc);
-    dispatcher disp(microseconds(latency_goal), cons, disp_proc, goal_factor);
-    producer prod(prod_rate, disp, prod_proc);
-    duration<double> _verb(0.0);
-    unsigned long max_queued = 0;
-    unsigned long max_executed = 0;
+    void submit(request_pool::handle rq) {
+        void* buf;
+        if (_free.empty()) {
+            if (posix_memalign(&buf, 4096, _size) != 0) {
+                throw std::runtime_error("cannot allocate buffer");
+            }
+        } else {
+            buf = _free.back();
+            _free.pop_back();
+        }
 
-    duration<double> now(0.0);
-    while (now <= seconds(total_sec)) {
-        cons.tick(now);
-        prod.tick(now);
-        disp.tick(now);
+        off_t off = _rs.next_below(_blocks) * _size;
+        while (!_ring.prepare(IORING_OP_READ, _fd, buf, _size, off, 0, _id)) {
+            _ring.submit();
+        }
+        _inflight.emplace(_id++, io{rq, buf});
+    }
 
-        max_queued = std::max(max_queued, disp.queued());
-        max_executed = std::max(max_executed, cons.executing());
-        if (now >= _verb) {
-#if VERB
-            fmt::print("{:5}   {:10}/{:<10}   g {:<10.0f} d {:<10.0f} c {:<10.0f}\n", now,
-                    disp.queued(), max_queued,
-                    prod.generated() / now.count(),
-                    disp.dispatched() / now.count(),
-                    cons.processed() / now.count()
-                    );
-#endif
-            _verb += seconds(1);
+    void flush() {
+        _ring.submit();
+    }
+
+    // Calls fn(rq, ok) for every completed read, failed and short reads
+    // are not ok
+    template <typename Func>
+    void reap(Func&& fn) {
+        _ring.reap([this, &fn] (unsigned long id, int res) {
+            auto it = _inflight.find(id);
+            _free.push_back(it->second.buf);
+            fn(it->second.rq, res == int(_size));
+            _inflight.erase(it);
+        });
+    }
+
+    unsigned long inflight() const noexcept { return _inflight.size(); }
+};
+
+// The consumer is a serial server whose service times come from the process,
+// or, if the process is "profile", a parallel device whose latencies depend
+// on the number of requests in flight and come from the device profile, or,
+// if the process is "uring", the real device running in wall-clock time
+class consumer : public executor {
+    std::deque<request_pool::handle> _executing;
+    std::multimap<duration<double>, request_pool::handle> _inflight; // by device completion time
+    std::deque<request_pool::handle> _completions;
+    duration<double> _next;
+    unsigned long _processed;
+    collector& _st;
+    const duration<double> _lat;
+    std::unique_ptr<process> _pause;
+    const reaping _reaping;
+    const duration<double> _wakeup_latency;
+    duration<double> _reap_delay;
+    duration<double> _max_reap_delay;
+    modulator _mod;
+    // Wall time the device didn't serve requests being stalled or degraded,
+    // the service process runs in device time which is now - _lost
+    duration<double> _lost;
+    duration<double> _last;
+    duration<double> _busy; // time with requests on the device
+    std::shared_ptr<const device_profile> _profile;
+    random_stream _rs; // for the profile, the process has its own copy
+    std::unique_ptr<uring_device> _dev;
+    unsigned long _failed; // device reads
+
+    void complete(duration<double> now, request_pool::handle rq) {
+        if (_reaping == reaping::instant) {
+            _st.collect(now - _pool.start(rq), now - _pool.dispatch(rq));
+            _processed++;
+            notify(now, rq);
+        } else {
+            _pool.complete(rq) = now;
+            _completions.push_back(rq);
         }
+    }
 
-        now += microseconds(1);
+public:
+    consumer(request_pool& pool, unsigned rps, collector& st, std::string proc, random_stream rs, reaping mode = reaping::instant, duration<double> wakeup_latency = duration<double>(0.0),
+            modulator mod = {}, std::shared_ptr<const device_profile> profile = nullptr, std::unique_ptr<uring_device> dev = nullptr)
+            : executor(pool)
+            , _processed(0)
+            , _st(st)
+            , _lat(1.0 / rps)
+            , _pause(proc == "profile" || proc == "uring" ? nullptr : make_process(proc, _lat, rs))
+            , _reaping(mode)
+            , _wakeup_latency(wakeup_latency)
+            , _reap_delay(0.0)
+            , _max_reap_delay(0.0)
+            , _mod(std::move(mod))
+            , _lost(0.0)
+            , _last(0.0)
+            , _busy(0.0)
+            , _profile(std::move(profile))
+            , _rs(rs)
+            , _dev(std::move(dev))
+            , _failed(0)
+    {
+        if (proc == "profile" && !_profile) {
+            throw std::runtime_error("profile consumer needs --profile");
+        }
+        if (proc == "uring" && !_dev) {
+            throw std::runtime_error("uring consumer needs --file");
+        }
+        if (proc != "profile" && _profile) {
+            throw std::runtime_error("--profile needs the profile consumer");
+        }
+        if (proc != "uring" && _dev) {
+            throw std::runtime_error("--file needs the uring consumer");
+        }
     }
 
-    fmt::print("producer rate: {} consumer rate: {} maximum queued: {} executing: {}\n", prod_rate, cons_rate, max_queued, max_executed);
-    fmt::print("total latencies: mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n", st.mean_lat().count(), st.p95_lat().count(), st.p99_lat().count(), st.max_lat().count());
-    fmt::print("exec latencies:  mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n", st.mean_xlat().count(), st.p95_xlat().count(), st.p99_xlat().count(), st.max_xlat().count());
+    void tick(duration<double> now) {
+        _mod.tick(now);
+        _lost += (now - _last) * (1.0 - _mod.speed(now));
+        if (!_executing.empty() || !_inflight.empty() || (_dev && _dev->inflight() > 0)) {
+            _busy += now - _last;
+        }
+        _last = now;
+
+        while (!_executing.empty() > 0 && now - _lost >= _next) {
+            complete(now, _executing.front());
+            _executing.pop_front();
+            _next += _pause->get();
+        }
+
+        while (!_inflight.empty() && now - _lost >= _inflight.begin()->first) {
+            complete(now, _inflight.begin()->second);
+            _inflight.erase(_inflight.begin());
+        }
+
+        if (_dev) {
+            _dev->reap([this, now] (request_pool::handle rq, bool ok) {
+                // Failed reads say nothing about the device latency, they
+                // leave without being collected
+                if (!ok) {
+                    _failed++;
+                    notify(now, rq);
+                    return;
+                }
+                complete(now, rq);
+            });
+        }
+    }
+
+    virtual void reap(duration<double> now) override {
+        while (!_completions.empty()) {
+            auto rq = _completions.front();
+            _completions.pop_front();
+            _st.collect(now - _pool.start(rq), now - _pool.dispatch(rq));
+            _reap_delay += now - _pool.complete(rq);
+            _max_reap_delay = std::max(_max_reap_delay, now - _pool.complete(rq));
+            _processed++;
+            notify(now, rq);
+        }
+    }
+
+    virtual void flush() override {
+        if (_dev) {
+            _dev->flush();
+        }
+    }
+
+    virtual duration<double> wakeup() const noexcept override {
+        if (_reaping != reaping::interrupt || _completions.empty()) {
+            return duration<double>::max();
+        }
+        return _pool.complete(_completions.front()) + _wakeup_latency;
+    }
+
+    virtual void execute(duration<double> now, request_pool::handle rq) override {
+        _pool.dispatch(rq) = now;
+        if (_dev) {
+            _dev->submit(rq);
+            return;
+        }
+        if (_profile) {
+            auto lat = _profile->sample(_inflight.size() + 1, _rs.next());
+            _inflight.emplace(now - _lost + lat, rq);
+            return;
+        }
+
+        if (_executing.empty()) {
+            _next = now - _lost + _pause->get();
+        }
+        _executing.push_back(rq);
+    }
+
+    virtual duration<double> latency() const noexcept override { return _lat; }
+    // Completed requests keep their slots until reaped
+    virtual unsigned long executing() const noexcept override {
+        return _executing.size() + _inflight.size() + _completions.size() + (_dev ? _dev->inflight() : 0);
+    }
+    unsigned long processed() const noexcept { return _processed; }
+    unsigned long failed() const noexcept { return _failed; }
+    reaping completion_mode() const noexcept { return _reaping; }
+    duration<double> reap_delay() const noexcept { return _reap_delay; }
+    duration<double> max_reap_delay() const noexcept { return _max_reap_delay; }
+    double speed(duration<double> now) const noexcept { return _mod.speed(now); }
+    duration<double> busy() const noexcept { return _busy; }
+};
+
+// Queue of requests stored as runs of plain ones arriving at regular
+// intervals, so an overloaded dispatcher holds a few runs instead of
+// millions of requests. Starts are on the exact engine's 1us ticks, and a
+// producer whose period is not a whole number of ticks arrives on an uneven
+// pattern of them. So a run keeps the range of steps that put every request
+// it holds within a tick of its real start, request i starts at first plus
+// i * step rounded to the tick, and a new request joins the run while that
+// range is not empty and it arrived right after the run's last one. Plain
+// requests that don't make runs are kept in blocks of tick deltas, a byte
+// per request. Starts off the tick grid (the emulation's wall-clock ones)
+// are runs of one. Requests leave the backlog as pooled handles, keeping
+// their arrival numbers. Keys only matter for routing and are not kept,
+// requests of scripted clients stay pooled while queued and are runs of one
+class backlog {
+    struct run {
+        duration<double> first;
+        // Steps in ticks a run's requests fit, for blocks the starts of the
+        // front and the back requests
+        double lo;
+        double hi;
+        uint64_t seq; // arrival number of request 0, the others follow it
+        uint32_t begin; // index of the front request
+        uint32_t end;
+        request_pool::handle rq; // the only request of a waiter's run
+        bool block;
+        std::vector<uint8_t> deltas; // ticks from block request i to i + 1
+
+        duration<double> at(uint32_t i) const noexcept {
+            return i == 0 ? first : first + tick * std::round(i * (lo + hi) / 2);
+        }
+    };
+
+    static constexpr duration<double> tick = duration<double, std::micro>(1.0);
+    static constexpr duration<double> tolerance = duration<double, std::nano>(1.0);
+    static constexpr double unbounded = std::numeric_limits<double>::max();
+    static constexpr size_t max_block = 65536;
+
+    request_pool& _pool;
+    std::deque<run> _runs;
+    unsigned long _size = 0;
+    unsigned long _block_bytes = 0;
+
+    // Whole ticks from base to start, if start is on the tick grid
+    static std::optional<double> ticks(duration<double> base, duration<double> start) {
+        double n = std::round((start - base) / tick);
+        if (abs(base + tick * n - start) > tolerance) {
+            return std::nullopt;
+        }
+        return n;
+    }
+
+    request_pool::handle take(const run& r, uint32_t i) {
+        return r.rq != request_pool::none ? r.rq : _pool.alloc(r.at(i), r.seq + i);
+    }
+
+    bool join_run(run& r, duration<double> start) {
+        auto n = ticks(r.first, start);
+        if (!n) {
+            return false;
+        }
+        double lo = std::max(r.lo, (*n - 1) / r.end);
+        double hi = std::min(r.hi, (*n + 1) / r.end);
+        if (lo >= hi) {
+            return false;
+        }
+        r.lo = lo;
+        r.hi = hi;
+        r.end++;
+        return true;
+    }
+
+    bool join_block(run& r, duration<double> start) {
+        auto n = ticks(duration<double>(r.hi), start);
+        if (!n || *n < 0 || *n > 255 || r.deltas.size() == max_block) {
+            return false;
+        }
+        append(r, *n);
+        r.end++;
+        return true;
+    }
+
+    void append(run& r, double n) {
+        _block_bytes -= r.deltas.capacity();
+        r.deltas.push_back(n);
+        _block_bytes += r.deltas.capacity();
+        r.hi = (duration<double>(r.hi) + tick * n).count();
+    }
+
+    // A run that could not take its third request becomes a block
+    bool make_block(run& r, duration<double> start) {
+        if (r.begin != 0 || r.end != 2) {
+            return false;
+        }
+        auto second = r.at(1);
+        auto n1 = ticks(r.first, second);
+        auto n2 = ticks(second, start);
+        if (!n2 || *n2 < 0 || *n2 > 255 || *n1 > 255) {
+            return false;
+        }
+        r.block = true;
+        r.lo = r.hi = r.first.count();
+        append(r, *n1);
+        append(r, *n2);
+        r.end++;
+        return true;
+    }
+
+    void pop(std::deque<run>::iterator it) {
+        _block_bytes -= it->deltas.capacity();
+        _runs.erase(it);
+    }
+
+public:
+    explicit backlog(request_pool& pool) : _pool(pool) {}
+
+    void push_back(duration<double> start, uint64_t seq) {
+        _size++;
+        if (!_runs.empty()) {
+            auto& r = _runs.back();
+            if (r.rq == request_pool::none && r.end != UINT32_MAX && seq == r.seq + r.end) {
+                if (r.block ? join_block(r, start) : join_run(r, start) || make_block(r, start)) {
+                    return;
+                }
+            }
+        }
+        _runs.push_back(run{start, -unbounded, unbounded, seq, 0, 1, request_pool::none, false, {}});
+    }
+
+    void push_back(request_pool::handle rq) {
+        if (!_pool.wait(rq)) {
+            push_back(_pool.start(rq), _pool.seq(rq));
+            _pool.release(rq);
+            return;
+        }
+        _size++;
+        _runs.push_back(run{_pool.start(rq), -unbounded, unbounded, _pool.seq(rq), 0, 1, rq, false, {}});
+    }
+
+    request_pool::handle pop_front() {
+        _size--;
+        auto& r = _runs.front();
+        if (r.block) {
+            auto rq = _pool.alloc(duration<double>(r.lo), r.seq + r.begin);
+            if (r.begin + 1 < r.end) {
+                r.lo = (duration<double>(r.lo) + tick * double(r.deltas[r.begin])).count();
+            }
+            if (++r.begin == r.end) {
+                pop(_runs.begin());
+            }
+            return rq;
+        }
+        auto rq = take(r, r.begin);
+        if (++r.begin == r.end) {
+            pop(_runs.begin());
+        }
+        return rq;
+    }
+
+    request_pool::handle pop_back() {
+        _size--;
+        auto& r = _runs.back();
+        if (r.block) {
+            auto rq = _pool.alloc(duration<double>(r.hi), r.seq + r.end - 1);
+            if (r.end - 1 > r.begin) {
+                r.hi = (duration<double>(r.hi) - tick * double(r.deltas[r.end - 2])).count();
+            }
+            if (--r.end == r.begin) {
+                pop(_runs.end() - 1);
+            }
+            return rq;
+        }
+        auto rq = take(r, r.end - 1);
+        if (--r.end == r.begin) {
+            pop(_runs.end() - 1);
+        }
+        return rq;
+    }
+
+    bool empty() const noexcept { return _size == 0; }
+    unsigned long size() const noexcept { return _size; }
+    unsigned long runs() const noexcept { return _runs.size(); }
+    unsigned long memory() const noexcept { return _runs.size() * sizeof(run) + _block_bytes; }
+};
+
+class dispatcher {
+    std::unique_ptr<process> _pause;
+    duration<double> _next;
+    executor& _cons;
+    request_pool& _pool;
+    // Owner dispatches from the front, thieves take from the back. The
+    // queue can be shared by all dispatchers instead
+    backlog _own;
+    backlog& _queue;
+    unsigned long _dispatched;
+    unsigned long _polls;
+    const unsigned long _limit;
+    std::unique_ptr<policy> _policy;
+    flight_recorder* _rec = nullptr;
+    unsigned _shard = 0;
+
+public:
+    dispatcher(request_pool& pool, duration<double> lat, executor& c, std::string proc, random_stream rs, float goal_factor, unsigned long limit = 0,
+            std::string policy_name = "", std::string policy_args = "", backlog* shared_queue = nullptr)
+            : _pause(proc == "reactor" ? nullptr : make_process(proc, lat, rs))
+            , _next(0.0)
+            , _pool(pool)
+            , _own(pool)
+            , _queue(shared_queue ? *shared_queue : _own)
+            , _dispatched(0)
+            , _polls(0)
+            , _cons(c)
+            , _limit(limit != 0 ? limit : (unsigned long)(lat * goal_factor / _cons.latency()))
+    {
+#if VERB
+        fmt::print("Consumer limit {} requests, goal {}ms factor {}\n", _limit, lat.count() * 1000, goal_factor);
+#endif
+        if (_limit == 0) {
+            throw std::runtime_error("Too low consumer rate");
+        }
+        if (!policy_name.empty()) {
+            qd_policy_env env{lat.count(), goal_factor, _cons.latency().count(), _limit, policy_args.c_str()};
+            _policy = std::make_unique<policy>(policy_name, env);
+            _cons.set_policy(_policy.get());
+        }
+    }
+
+    ~dispatcher() {
+        _cons.set_policy(nullptr);
+    }
+
+    void set_recorder(flight_recorder* rec, unsigned shard) noexcept {
+        _rec = rec;
+        _shard = shard;
+        _cons.set_recorder(rec, shard);
+    }
+
+    void queue(duration<double> now, waiter* w = nullptr) {
+        auto seq = _pool.next_seq();
+        if (w) {
+            _queue.push_back(_pool.alloc(now, seq, w));
+        } else {
+            _queue.push_back(now, seq);
+        }
+        if (_policy) {
+            _policy->queue(now);
+        }
+        if (_rec) {
+            _rec->arrived(now, _shard, seq, _queue.size());
+        }
+    }
+
+    // Without the pause process the dispatcher is polled by the reactor
+    void tick(duration<double> now) {
+        if (!_pause) {
+            return;
+        }
+
+        if (now >= _next) {
+            _next += _pause->get();
+            poll(now);
+        } else if (now >= _cons.wakeup()) {
+            poll(now);
+        }
+    }
+
+    unsigned long poll(duration<double> now) {
+        unsigned long dispatched = 0;
+
+        _polls++;
+        _cons.reap(now);
+
+        unsigned long executing = _cons.executing();
+        unsigned long allowed = _policy ? _policy->tick(now, _queue.size(), executing) : (executing >= _limit ? 0 : _limit - executing);
+        while (!_queue.empty() && dispatched < allowed) {
+            auto rq = _queue.pop_front();
+            if (_rec) {
+                _rec->record(now, flight_recorder::dispatch, _shard, _pool.seq(rq), executing + dispatched + 1);
+            }
+            _cons.execute(now, rq);
+            _dispatched++;
+            dispatched++;
+        }
+        if (_rec) {
+            if (!_queue.empty()) {
+                _rec->record(now, flight_recorder::limit, _shard, flight_recorder::no_request, executing + dispatched);
+            }
+            _rec->record(now, flight_recorder::poll, _shard, flight_recorder::no_request, dispatched);
+        }
+
+        _cons.flush();
+        return dispatched;
+    }
+
+    // Takes up to n newest requests, oldest first
+    std::vector<request_pool::handle> steal(unsigned long n) {
+        std::vector<request_pool::handle> ret;
+        while (!_queue.empty() && ret.size() < n) {
+            ret.push_back(_queue.pop_back());
+        }
+        std::reverse(ret.begin(), ret.end());
+        return ret;
+    }
+
+    void adopt(duration<double> now, std::vector<request_pool::handle>&& rqs) {
+        for (auto rq : rqs) {
+            _queue.push_back(rq);
+            if (_policy) {
+                _policy->queue(now);
+            }
+        }
+    }
+
+    // Could dispatch more but has nothing to
+    bool idle() const noexcept { return _queue.empty() && _cons.executing() < _limit; }
+    unsigned long queued() const noexcept { return _queue.size(); }
+    unsigned long executing() const noexcept { return _cons.executing(); }
+    unsigned long dispatched() const noexcept { return _dispatched; }
+    unsigned long polls() const noexcept { return _polls; }
+    unsigned long memory() const noexcept { return _own.memory(); }
+};
+
+// Sends requests to shards, each being a dispatcher with its consumer.
+// Key-based routing uses the hash of the request key or splits the key
+// space in ranges. Load-based routing looks at the shards' loads, which are
+// sampled every report period and seen by the router after the report delay
+//  jsq  -- join the shortest dispatcher queue
+//  pod  -- power of d choices, the least loaded of d random shards
+//  low  -- least outstanding work, queued plus executing requests
+//  jiq  -- join idle queue, shards report becoming idle and get the next
+//          requests, or a random shard if none is idle
+enum class routing { hash, range, jsq, pod, low, jiq };
+
+static routing parse_routing(std::string mode) {
+    if (mode == "hash") {
+        return routing::hash;
+    }
+    if (mode == "range") {
+        return routing::range;
+    }
+    if (mode == "jsq") {
+        return routing::jsq;
+    }
+    if (mode == "pod") {
+        return routing::pod;
+    }
+    if (mode == "low") {
+        return routing::low;
+    }
+    if (mode == "jiq") {
+        return routing::jiq;
+    }
+
+    throw std::runtime_error(fmt::format("unknown routing {}", mode));
+}
+
+// Whoever takes requests from the producer
+class request_sink {
+public:
+    virtual void queue(duration<double> now, unsigned long key, waiter* w = nullptr) = 0;
+    virtual ~request_sink() = default;
+};
+
+class router : public request_sink {
+    struct load {
+        unsigned long queued;
+        unsigned long executing;
+    };
+
+    std::vector<dispatcher*> _shards;
+    const routing _mode;
+    const unsigned long _keys;
+    const duration<double> _period;
+    const duration<double> _delay;
+    const unsigned _d;
+    std::vector<load> _seen;
+    std::list<std::pair<duration<double>, std::vector<load>>> _reports; // in flight to the router
+    std::vector<unsigned> _idle;
+    std::vector<bool> _listed; // in _idle, a shard is listed once
+    duration<double> _next_report;
+    random_stream _rs;
+
+    static unsigned long mix(unsigned long k) noexcept {
+        k ^= k >> 30;
+        k *= 0xbf58476d1ce4e5b9ul;
+        k ^= k >> 27;
+        k *= 0x94d049bb133111ebul;
+        return k ^ (k >> 31);
+    }
+
+    unsigned long weight(unsigned i) const noexcept {
+        return _mode == routing::jsq ? _seen[i].queued : _seen[i].queued + _seen[i].executing;
+    }
+
+    unsigned random_shard() {
+        return _rs.next_below(_shards.size());
+    }
+
+    void deliver(const std::vector<load>& loads) {
+        for (unsigned i = 0; i < loads.size(); i++) {
+            bool idle = loads[i].queued + loads[i].executing == 0;
+            bool was_idle = _seen[i].queued + _seen[i].executing == 0;
+            if (_mode == routing::jiq && idle && !was_idle && !_listed[i]) {
+                _idle.push_back(i);
+                _listed[i] = true;
+            }
+            _seen[i] = loads[i];
+        }
+    }
+
+public:
+    router(std::vector<dispatcher*> shards, routing mode, unsigned long keys, random_stream rs,
+            duration<double> period = duration<double>(0.0), duration<double> delay = duration<double>(0.0), unsigned d = 2)
+            : _shards(std::move(shards))
+            , _mode(mode)
+            , _keys(keys)
+            , _period(period)
+            , _delay(delay)
+            , _d(std::max(d, 1u))
+            , _seen(_shards.size(), load{0, 0})
+            , _listed(_shards.size(), true)
+            , _next_report(0.0)
+            , _rs(rs)
+    {
+        for (unsigned i = 0; i < _shards.size(); i++) {
+            _idle.push_back(i);
+        }
+    }
+
+    bool load_based() const noexcept { return _mode != routing::hash && _mode != routing::range; }
+
+    void tick(duration<double> now) {
+        if (!load_based() || _shards.size() == 1) {
+            return;
+        }
+
+        if (now >= _next_report) {
+            _next_report = _period.count() > 0.0 ? _next_report + _period : now;
+            std::vector<load> loads;
+            loads.reserve(_shards.size());
+            for (auto d : _shards) {
+                loads.push_back(load{d->queued(), d->executing()});
+            }
+            if (_delay.count() == 0.0) {
+                deliver(loads);
+                return;
+            }
+            _reports.emplace_back(now + _delay, std::move(loads));
+        }
+
+        while (!_reports.empty() && _reports.front().first <= now) {
+            deliver(_reports.front().second);
+            _reports.pop_front();
+        }
+    }
+
+    unsigned shard(unsigned long key) {
+        if (_shards.size() == 1) {
+            return 0;
+        }
+
+        switch (_mode) {
+        case routing::hash:
+            return mix(key) % _shards.size();
+        case routing::range:
+            return (unsigned __int128)key * _shards.size() / _keys;
+        case routing::jsq:
+        case routing::low: {
+            // Scanning from a random shard breaks ties between equally
+            // loaded shards randomly rather than towards the first ones
+            unsigned start = random_shard();
+            unsigned best = start;
+            for (unsigned c = 1; c < _shards.size(); c++) {
+                unsigned i = (start + c) % _shards.size();
+                if (weight(i) < weight(best)) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+        case routing::pod: {
+            unsigned best = random_shard();
+            for (unsigned c = 1; c < _d; c++) {
+                unsigned i = random_shard();
+                if (weight(i) < weight(best)) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+        case routing::jiq:
+            if (!_idle.empty()) {
+                unsigned i = _idle.back();
+                _idle.pop_back();
+                _listed[i] = false;
+                return i;
+            }
+            return random_shard();
+        }
+        return 0;
+    }
+
+    virtual void queue(duration<double> now, unsigned long key, waiter* w = nullptr) override {
+        _shards[shard(key)]->queue(now, w);
+    }
+};
+
+// Idle shards take half of the queue of a busy one. Stolen requests reach
+// the thief after the steal latency plus the cost of moving each of them,
+// a shard has at most one steal in flight
+//  random  -- a random victim
+//  busiest -- the longest queue
+//  pod     -- the longer queue of two random shards
+enum class stealing { off, random, busiest, pod };
+
+static stealing parse_stealing(std::string mode) {
+    if (mode == "off") {
+        return stealing::off;
+    }
+    if (mode == "random") {
+        return stealing::random;
+    }
+    if (mode == "busiest") {
+        return stealing::busiest;
+    }
+    if (mode == "pod") {
+        return stealing::pod;
+    }
+
+    throw std::runtime_error(fmt::format("unknown stealing {}", mode));
+}
+
+class stealer {
+    struct transfer {
+        duration<double> arrive;
+        unsigned thief;
+        std::vector<request_pool::handle> requests;
+    };
+
+    std::vector<dispatcher*> _shards;
+    const stealing _mode;
+    const duration<double> _latency;
+    const duration<double> _cost;
+    const unsigned long _min; // shorter queues are left alone
+    std::vector<bool> _stealing;
+    std::vector<transfer> _transfers;
+    unsigned long _steals;
+    unsigned long _stolen;
+    random_stream _rs;
+
+    unsigned other(unsigned thief) {
+        unsigned v = _rs.next_below(_shards.size() - 1);
+        return v >= thief ? v + 1 : v;
+    }
+
+    unsigned victim(unsigned thief) {
+        switch (_mode) {
+        case stealing::random:
+            return other(thief);
+        case stealing::pod: {
+            unsigned a = other(thief);
+            unsigned b = other(thief);
+            return _shards[a]->queued() >= _shards[b]->queued() ? a : b;
+        }
+        case stealing::busiest:
+        case stealing::off:
+            break;
+        }
+        unsigned best = thief == 0 ? 1 : 0;
+        for (unsigned i = 0; i < _shards.size(); i++) {
+            if (i != thief && _shards[i]->queued() > _shards[best]->queued()) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+public:
+    stealer(std::vector<dispatcher*> shards, stealing mode, duration<double> latency, duration<double> cost, unsigned long min, random_stream rs)
+            : _shards(std::move(shards))
+            , _mode(mode)
+            , _latency(latency)
+            , _cost(cost)
+            , _min(std::max(min, 1ul))
+            , _stealing(_shards.size(), false)
+            , _steals(0)
+            , _stolen(0)
+            , _rs(rs)
+    {
+    }
+
+    void tick(duration<double> now) {
+        if (_mode == stealing::off || _shards.size() == 1) {
+            return;
+        }
+
+        for (unsigned i = 0; i < _transfers.size();) {
+            if (_transfers[i].arrive <= now) {
+                _shards[_transfers[i].thief]->adopt(now, std::move(_transfers[i].requests));
+                _stealing[_transfers[i].thief] = false;
+                _transfers[i] = std::move(_transfers.back());
+                _transfers.pop_back();
+            } else {
+                i++;
+            }
+        }
+
+        for (unsigned i = 0; i < _shards.size(); i++) {
+            if (_stealing[i] || !_shards[i]->idle()) {
+                continue;
+            }
+            auto v = _shards[victim(i)];
+            if (v->queued() < _min) {
+                continue;
+            }
+            auto rqs = v->steal((v->queued() + 1) / 2);
+            _steals++;
+            _stolen += rqs.size();
+            _stealing[i] = true;
+            _transfers.push_back(transfer{now + _latency + _cost * double(rqs.size()), i, std::move(rqs)});
+        }
+    }
+
+    unsigned long steals() const noexcept { return _steals; }
+    unsigned long stolen() const noexcept { return _stolen; }
+};
+
+// Cache in front of the dispatchers. Hits complete after the hit latency
+// without going further, misses are inserted into the cache and forwarded.
+// Policies keep everything in flat arrays indexed by slot numbers and find
+// keys with an open-addressing map, lookups are a hash probe and a few
+// array updates
+
+// Key -> slot map, linear probing with backward-shift deletion
+class slot_map {
+    static constexpr unsigned long empty = ~0ul;
+
+    struct entry {
+        unsigned long key;
+        uint32_t slot;
+    };
+
+    std::vector<entry> _entries;
+    unsigned long _mask;
+
+    static unsigned long mix(unsigned long k) noexcept {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdul;
+        return k ^ (k >> 33);
+    }
+
+public:
+    explicit slot_map(unsigned long capacity) {
+        unsigned long size = 16;
+        while (size < capacity * 2) {
+            size <<= 1;
+        }
+        _entries.assign(size, entry{empty, 0});
+        _mask = size - 1;
+    }
+
+    uint32_t* find(unsigned long key) noexcept {
+        for (unsigned long i = mix(key) & _mask;; i = (i + 1) & _mask) {
+            if (_entries[i].key == key) {
+                return &_entries[i].slot;
+            }
+            if (_entries[i].key == empty) {
+                return nullptr;
+            }
+        }
+    }
+
+    void insert(unsigned long key, uint32_t slot) noexcept {
+        unsigned long i = mix(key) & _mask;
+        while (_entries[i].key != empty) {
+            i = (i + 1) & _mask;
+        }
+        _entries[i] = entry{key, slot};
+    }
+
+    void erase(unsigned long key) noexcept {
+        unsigned long i = mix(key) & _mask;
+        while (_entries[i].key != key) {
+            if (_entries[i].key == empty) {
+                return;
+            }
+            i = (i + 1) & _mask;
+        }
+
+        // Shift back the entries that were displaced past the hole
+        for (unsigned long j = (i + 1) & _mask; _entries[j].key != empty; j = (j + 1) & _mask) {
+            unsigned long home = mix(_entries[j].key) & _mask;
+            if (((j - home) & _mask) >= ((j - i) & _mask)) {
+                _entries[i] = _entries[j];
+                i = j;
+            }
+        }
+        _entries[i].key = empty;
+    }
+};
+
+// Fixed-capacity FIFO
+template <typename T>
+class fifo_ring {
+    std::vector<T> _items;
+    unsigned long _head = 0;
+    unsigned long _size = 0;
+
+public:
+    explicit fifo_ring(unsigned long capacity) : _items(std::max(capacity, 1ul)) {}
+
+    void push(T v) noexcept {
+        _items[(_head + _size++) % _items.size()] = v;
+    }
+
+    T pop() noexcept {
+        T v = _items[_head];
+        _head = (_head + 1) % _items.size();
+        _size--;
+        return v;
+    }
+
+    unsigned long size() const noexcept { return _size; }
+    bool full() const noexcept { return _size == _items.size(); }
+};
+
+class cache_policy {
+public:
+    // Returns whether the key is cached, inserts it if it's not
+    virtual bool lookup(unsigned long key) = 0;
+    virtual ~cache_policy() = default;
+};
+
+// LRU list of keys, slot 0 is the list head
+class lru_list {
+    struct node {
+        unsigned long key;
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    std::vector<node> _nodes;
+    slot_map _map;
+    uint32_t _used;
+
+    void unlink(uint32_t i) noexcept {
+        _nodes[_nodes[i].prev].next = _nodes[i].next;
+        _nodes[_nodes[i].next].prev = _nodes[i].prev;
+    }
+
+    void push_front(uint32_t i) noexcept {
+        _nodes[i].prev = 0;
+        _nodes[i].next = _nodes[0].next;
+        _nodes[_nodes[0].next].prev = i;
+        _nodes[0].next = i;
+    }
+
+public:
+    explicit lru_list(unsigned long capacity) : _nodes(std::max(capacity, 1ul) + 1), _map(capacity), _used(0) {
+        _nodes[0].prev = _nodes[0].next = 0;
+    }
+
+    bool touch(unsigned long key) noexcept {
+        auto slot = _map.find(key);
+        if (!slot) {
+            return false;
+        }
+        unlink(*slot);
+        push_front(*slot);
+        return true;
+    }
+
+    bool full() const noexcept { return _used == _nodes.size() - 1; }
+    unsigned long victim() const noexcept { return _nodes[_nodes[0].prev].key; }
+
+    // Inserts an absent key evicting the least recently used one if full
+    std::optional<unsigned long> insert(unsigned long key) noexcept {
+        std::optional<unsigned long> evicted;
+        uint32_t i;
+        if (full()) {
+            i = _nodes[0].prev;
+            evicted = _nodes[i].key;
+            _map.erase(_nodes[i].key);
+            unlink(i);
+        } else {
+            i = ++_used;
+        }
+        _nodes[i].key = key;
+        push_front(i);
+        _map.insert(key, i);
+        return evicted;
+    }
+};
+
+class lru_cache : public cache_policy {
+    lru_list _lru;
+
+public:
+    explicit lru_cache(unsigned long capacity) : _lru(capacity) {}
+
+    virtual bool lookup(unsigned long key) override {
+        if (_lru.touch(key)) {
+            return true;
+        }
+        _lru.insert(key);
+        return false;
+    }
+};
+
+class clock_cache : public cache_policy {
+    std::vector<unsigned long> _keys;
+    std::vector<uint8_t> _ref;
+    slot_map _map;
+    unsigned long _used;
+    unsigned long _hand;
+
+public:
+    explicit clock_cache(unsigned long capacity)
+            : _keys(std::max(capacity, 1ul))
+            , _ref(std::max(capacity, 1ul))
+            , _map(capacity)
+            , _used(0)
+            , _hand(0)
+    {
+    }
+
+    virtual bool lookup(unsigned long key) override {
+        if (auto slot = _map.find(key)) {
+            _ref[*slot] = 1;
+            return true;
+        }
+
+        unsigned long i;
+        if (_used < _keys.size()) {
+            i = _used++;
+        } else {
+            while (_ref[_hand]) {
+                _ref[_hand] = 0;
+                _hand = (_hand + 1) % _keys.size();
+            }
+            i = _hand;
+            _hand = (_hand + 1) % _keys.size();
+            _map.erase(_keys[i]);
+        }
+        _keys[i] = key;
+        _ref[i] = 0;
+        _map.insert(key, i);
+        return false;
+    }
+};
+
+// S3-FIFO (Yang et al., SOSP'23): new keys go to the small FIFO, the ones
+// accessed again while there are promoted to the main FIFO, the rest are
+// remembered in the ghost FIFO and go to the main one if seen again soon
+class s3fifo_cache : public cache_policy {
+    struct object {
+        unsigned long key;
+        uint8_t freq;
+    };
+
+    std::vector<object> _objects;
+    std::vector<uint32_t> _free;
+    fifo_ring<uint32_t> _small;
+    fifo_ring<uint32_t> _main;
+    fifo_ring<std::pair<unsigned long, uint32_t>> _ghost; // key and generation
+    slot_map _map;
+    slot_map _ghosts; // key -> generation of its latest ghost entry
+    const unsigned long _capacity;
+    const unsigned long _small_capacity;
+    uint32_t _generation;
+
+    void remember(unsigned long key) {
+        if (_ghost.full()) {
+            auto [old, gen] = _ghost.pop();
+            auto g = _ghosts.find(old);
+            if (g && *g == gen) {
+                _ghosts.erase(old);
+            }
+        }
+        if (auto g = _ghosts.find(key)) {
+            *g = ++_generation;
+        } else {
+            _ghosts.insert(key, ++_generation);
+        }
+        _ghost.push({key, _generation});
+    }
+
+    void evict_main() {
+        for (;;) {
+            uint32_t i = _main.pop();
+            if (_objects[i].freq > 0) {
+                _objects[i].freq--;
+                _main.push(i);
+                continue;
+            }
+            _map.erase(_objects[i].key);
+            _free.push_back(i);
+            return;
+        }
+    }
+
+    void evict_small() {
+        while (_small.size() > 0) {
+            uint32_t i = _small.pop();
+            if (_objects[i].freq > 1) {
+                if (_main.size() >= _capacity - _small_capacity) {
+                    evict_main();
+                }
+                _objects[i].freq = 0;
+                _main.push(i);
+                continue;
+            }
+            remember(_objects[i].key);
+            _map.erase(_objects[i].key);
+            _free.push_back(i);
+            return;
+        }
+    }
+
+    void evict() {
+        if (_small.size() >= _small_capacity || _main.size() == 0) {
+            evict_small();
+        } else {
+            evict_main();
+        }
+    }
+
+public:
+    explicit s3fifo_cache(unsigned long capacity)
+            : _objects(std::max(capacity, 2ul))
+            , _small(std::max(capacity, 2ul))
+            , _main(std::max(capacity, 2ul))
+            , _ghost(std::max(capacity, 2ul) * 9 / 10)
+            , _map(std::max(capacity, 2ul))
+            , _ghosts(std::max(capacity, 2ul))
+            , _capacity(std::max(capacity, 2ul))
+            , _small_capacity(std::max(_capacity / 10, 1ul))
+            , _generation(0)
+    {
+        for (uint32_t i = _capacity; i > 0; i--) {
+            _free.push_back(i - 1);
+        }
+    }
+
+    virtual bool lookup(unsigned long key) override {
+        if (auto slot = _map.find(key)) {
+            auto& f = _objects[*slot].freq;
+            f = std::min<uint8_t>(f + 1, 3);
+            return true;
+        }
+
+        while (_free.empty()) {
+            evict();
+        }
+        uint32_t i = _free.back();
+        _free.pop_back();
+        _objects[i] = object{key, 0};
+        _map.insert(key, i);
+
+        auto g = _ghosts.find(key);
+        if (g) {
+            _ghosts.erase(key);
+            if (_main.size() >= _capacity - _small_capacity) {
+                evict_main();
+            }
+            _main.push(i);
+        } else {
+            _small.push(i);
+        }
+        return false;
+    }
+};
+
+// W-TinyLFU (Einziger et al.): a small LRU window in front of the main LRU,
+// window victims only get into the main LRU if a count-min sketch says they
+// are more popular than the main LRU victim. Sketch counters are halved once
+// in a while so that the popularity ages. All counters of a key live in one
+// 64-byte block so that counting costs a single cache miss
+class tinylfu_cache : public cache_policy {
+    static constexpr unsigned rows = 4;
+    static constexpr unsigned row_width = 16;
+
+    lru_list _window;
+    lru_list _main;
+    std::vector<uint8_t> _sketch;
+    unsigned long _blocks_mask;
+    unsigned long _samples;
+    const unsigned long _reset;
+
+    static unsigned long hash(unsigned long key) noexcept {
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ul;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebul;
+        return key ^ (key >> 31);
+    }
+
+    static unsigned long counter(unsigned long h, unsigned long block, unsigned r) noexcept {
+        return block * rows * row_width + r * row_width + ((h >> (32 + r * 4)) & (row_width - 1));
+    }
+
+    void increment(unsigned long key) noexcept {
+        unsigned long h = hash(key);
+        unsigned long block = h & _blocks_mask;
+        for (unsigned r = 0; r < rows; r++) {
+            auto& c = _sketch[counter(h, block, r)];
+            if (c < 15) {
+                c++;
+            }
+        }
+        if (++_samples == _reset) {
+            for (auto& c : _sketch) {
+                c >>= 1;
+            }
+            _samples /= 2;
+        }
+    }
+
+    unsigned frequency(unsigned long key) const noexcept {
+        unsigned long h = hash(key);
+        unsigned long block = h & _blocks_mask;
+        unsigned f = 15;
+        for (unsigned r = 0; r < rows; r++) {
+            f = std::min<unsigned>(f, _sketch[counter(h, block, r)]);
+        }
+        return f;
+    }
+
+public:
+    explicit tinylfu_cache(unsigned long capacity)
+            : _window(std::max(capacity / 100, 1ul))
+            , _main(std::max(capacity - std::max(capacity / 100, 1ul), 1ul))
+            , _samples(0)
+            , _reset(std::max(capacity, 1ul) * 10)
+    {
+        unsigned long blocks = 1;
+        while (blocks * row_width < capacity) {
+            blocks <<= 1;
+        }
+        _sketch.assign(blocks * rows * row_width, 0);
+        _blocks_mask = blocks - 1;
+    }
+
+    virtual bool lookup(unsigned long key) override {
+        increment(key);
+        if (_window.touch(key) || _main.touch(key)) {
+            return true;
+        }
+
+        auto candidate = _window.insert(key);
+        if (candidate) {
+            if (!_main.full() || frequency(*candidate) > frequency(_main.victim())) {
+                _main.insert(*candidate);
+            }
+        }
+        return false;
+    }
+};
+
+static std::unique_ptr<cache_policy> make_cache(std::string policy, unsigned long capacity) {
+    if (policy == "lru") {
+        return std::make_unique<lru_cache>(capacity);
+    }
+    if (policy == "clock") {
+        return std::make_unique<clock_cache>(capacity);
+    }
+    if (policy == "s3fifo") {
+        return std::make_unique<s3fifo_cache>(capacity);
+    }
+    if (policy == "tinylfu") {
+        return std::make_unique<tinylfu_cache>(capacity);
+    }
+
+    throw std::runtime_error(fmt::format("unknown cache policy {}", policy));
+}
+
+class cache_stage : public request_sink {
+    request_sink& _next;
+    std::unique_ptr<cache_policy> _cache;
+    const duration<double> _hit_latency;
+    collector& _st;
+    request_pool& _pool;
+    std::deque<request_pool::handle> _hits; // in completion order, the hit latency is constant
+    unsigned long _lookups;
+    unsigned long _hit_count;
+
+public:
+    cache_stage(request_sink& next, std::unique_ptr<cache_policy> cache, duration<double> hit_latency, collector& st, request_pool& pool)
+            : _next(next)
+            , _cache(std::move(cache))
+            , _hit_latency(hit_latency)
+            , _st(st)
+            , _pool(pool)
+            , _lookups(0)
+            , _hit_count(0)
+    {
+    }
+
+    virtual void queue(duration<double> now, unsigned long key, waiter* w = nullptr) override {
+        _lookups++;
+        if (_cache->lookup(key)) {
+            _hit_count++;
+            _hits.push_back(_pool.alloc(now, w));
+        } else {
+            _next.queue(now, key, w);
+        }
+    }
+
+    void tick(duration<double> now) {
+        while (!_hits.empty() && now >= _pool.start(_hits.front()) + _hit_latency) {
+            auto rq = _hits.front();
+            _hits.pop_front();
+            _st.collect(now - _pool.start(rq), now - _pool.start(rq));
+            if (auto w = _pool.wait(rq)) {
+                w->wake(now, now - _pool.start(rq));
+            }
+            _pool.release(rq);
+        }
+    }
+
+    unsigned long lookups() const noexcept { return _lookups; }
+    unsigned long hits() const noexcept { return _hit_count; }
+};
+
+// Single-threaded reactor CPU. Producer continuations and completion handling
+// run as tasks and the dispatcher only runs when the reactor polls, which is
+// when the task queue drains or when the task quota expires. Like in seastar
+// tasks are not interrupted, preemption happens at task boundaries, so the
+// dispatch lag comes from the CPU load rather than from a pause process
+class reactor {
+    struct task {
+        duration<double> cost;
+        std::optional<duration<double>> start; // request to queue when the task completes
+        waiter* wait;
+        unsigned long key;
+    };
+
+    request_sink& _sink;
+    dispatcher& _disp;
+    consumer& _cons;
+    std::list<task> _tasks;
+    const duration<double> _quota;
+    const duration<double> _produce_cost;
+    const duration<double> _dispatch_cost;
+    const duration<double> _complete_cost;
+    duration<double> _clock;
+    duration<double> _last_poll;
+    duration<double> _busy;
+    duration<double> _max_poll_gap;
+    unsigned long _polls;
+    unsigned long _completed;
+    bool _sleeping;
+
+    void handle_completions() {
+        for (auto processed = _cons.processed(); _completed < processed; _completed++) {
+            _tasks.push_back(task{_complete_cost, std::nullopt, nullptr, 0});
+        }
+    }
+
+public:
+    reactor(request_sink& r, dispatcher& d, consumer& c, duration<double> quota, duration<double> produce_cost, duration<double> dispatch_cost, duration<double> complete_cost)
+            : _sink(r)
+            , _disp(d)
+            , _cons(c)
+            , _quota(quota)
+            , _produce_cost(produce_cost)
+            , _dispatch_cost(dispatch_cost)
+            , _complete_cost(complete_cost)
+            , _clock(0.0)
+            , _last_poll(0.0)
+            , _busy(0.0)
+            , _max_poll_gap(0.0)
+            , _polls(0)
+            , _completed(0)
+            , _sleeping(false)
+    {
+#if VERB
+        fmt::print("Reactor task quota {}us, costs: produce {}us dispatch {}us complete {}us\n",
+                quota.count() * 1000000, produce_cost.count() * 1000000, dispatch_cost.count() * 1000000, complete_cost.count() * 1000000);
+#endif
+        if (_quota.count() <= 0.0) {
+            throw std::runtime_error("Task quota must be positive");
+        }
+    }
+
+    void submit(duration<double> now, unsigned long key, waiter* w = nullptr) {
+        _tasks.push_back(task{_produce_cost, now, w, key});
+    }
+
+    void tick(duration<double> now) {
+        handle_completions();
+
+        // Idle reactor in interrupt mode sleeps until a completion wakes it up
+        if (_sleeping) {
+            if (_tasks.empty() && now < _cons.wakeup()) {
+                return;
+            }
+            _sleeping = false;
+        }
+
+        _clock = std::max(_clock, now);
+        while (_clock <= now) {
+            if (!_tasks.empty() && _clock - _last_poll < _quota) {
+                task t = _tasks.front();
+                _tasks.pop_front();
+                _clock += t.cost;
+                _busy += t.cost;
+                if (t.start) {
+                    _sink.queue(*t.start, t.key, t.wait);
+                }
+                continue;
+            }
+
+            _max_poll_gap = std::max(_max_poll_gap, _clock - _last_poll);
+            _last_poll = _clock;
+            _polls++;
+
+            unsigned long dispatched = _disp.poll(_clock);
+            _clock += dispatched * _dispatch_cost;
+            _busy += dispatched * _dispatch_cost;
+            handle_completions();
+
+            if (dispatched == 0 && _tasks.empty()) {
+                _sleeping = _cons.completion_mode() == reaping::interrupt;
+                break;
+            }
+        }
+    }
+
+    duration<double> busy() const noexcept { return _busy; }
+    duration<double> max_poll_gap() const noexcept { return _max_poll_gap; }
+    unsigned long polls() const noexcept { return _polls; }
+    unsigned long tasks() const noexcept { return _tasks.size(); }
+};
+
+class source {
+public:
+    virtual void tick(duration<double> now) = 0;
+    virtual unsigned long generated() const noexcept = 0;
+    virtual ~source() = default;
+};
+
+class producer : public source {
+    request_sink& _sink;
+    reactor* _reactor;
+    key_generator* _keys;
+    duration<double> _next;
+    unsigned long _generated;
+    std::unique_ptr<process> _pause;
+
+public:
+    producer(unsigned rps, request_sink& rt, std::string proc, random_stream rs, reactor* r = nullptr, key_generator* keys = nullptr)
+            : _pause(make_process(proc, duration<double>(1.0 / rps), rs))
+            , _sink(rt)
+            , _reactor(r)
+            , _keys(keys)
+            , _next(0.0)
+            , _generated(0)
+    {
+    }
+
+    virtual void tick(duration<double> now) override {
+        while (now >= _next) {
+            _next += _pause->get();
+            unsigned long key = _keys ? _keys->get() : 0;
+            if (_reactor) {
+                _reactor->submit(now, key);
+            } else {
+                _sink.queue(now, key);
+            }
+            _generated++;
+        }
+    }
+
+    virtual unsigned long generated() const noexcept override { return _generated; }
+};
+
+// Scripted producer runs a population of clients, each written as a
+// coroutine that issues requests and sleeps, e.g.
+//
+//     for (;;) {
+//         co_await c.issue();
+//         co_await c.sleep(c.think());
+//     }
+//
+// Coroutine frames are allocated from a per-engine pool, so clients cost
+// a frame and a client each and nothing is allocated in steady state
+class script_engine;
+
+class frame_pool {
+    std::unordered_map<size_t, std::vector<void*>> _free;
+    unsigned long _allocated = 0;
+
+public:
+    frame_pool() = default;
+    frame_pool(const frame_pool&) = delete;
+
+    ~frame_pool() {
+        for (auto& [size, frames] : _free) {
+            for (auto f : frames) {
+                ::operator delete(f);
+            }
+        }
+    }
+
+    void* allocate(size_t size) {
+        auto& frames = _free[size];
+        if (frames.empty()) {
+            _allocated++;
+            return ::operator new(size);
+        }
+        void* f = frames.back();
+        frames.pop_back();
+        return f;
+    }
+
+    void release(void* f, size_t size) {
+        _free[size].push_back(f);
+    }
+
+    unsigned long allocated() const noexcept { return _allocated; }
+};
+
+class client {
+    script_engine& _engine;
+    std::coroutine_handle<> _frame; // alive while not null
+
+public:
+    explicit client(script_engine& e) : _engine(e) {}
+    client(const client&) = delete;
+    ~client() {
+        if (_frame) {
+            _frame.destroy();
+        }
+    }
+
+    struct task {
+        struct promise_type {
+            client* owner = nullptr;
+
+            // Frames are prefixed with the pool they come from
+            static constexpr size_t header = alignof(std::max_align_t);
+
+            static void* operator new(size_t size, client& c) {
+                auto* p = static_cast<char*>(c.pool().allocate(size + header));
+                *reinterpret_cast<frame_pool**>(p) = &c.pool();
+                return p + header;
+            }
+
+            static void operator delete(void* ptr, size_t size) {
+                auto* p = static_cast<char*>(ptr) - header;
+                (*reinterpret_cast<frame_pool**>(p))->release(p, size + header);
+            }
+
+            promise_type(client& c) : owner(&c) {
+                c._frame = std::coroutine_handle<promise_type>::from_promise(*this);
+            }
+            ~promise_type() { owner->_frame = nullptr; }
+
+            task get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    struct issue_awaiter : waiter {
+        client& c;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        duration<double> await_resume() const noexcept { return latency; }
+    };
+
+    struct sleep_awaiter {
+        client& c;
+        duration<double> d;
+        bool await_ready() const noexcept { return d.count() <= 0.0; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume() const noexcept {}
+    };
+
+    // Sends a request and resumes when it's reaped with its latency
+    issue_awaiter issue() noexcept { return issue_awaiter{{nullptr, nullptr, duration<double>(0.0)}, *this}; }
+    sleep_awaiter sleep(duration<double> d) noexcept { return sleep_awaiter{*this, d}; }
+    duration<double> think();
+    const options& opts() const noexcept;
+
+private:
+    frame_pool& pool();
+};
+
+class script_engine : public source {
+    using timer = std::pair<duration<double>, std::coroutine_handle<>>;
+
+    request_sink& _sink;
+    reactor* _reactor;
+    key_generator* _keys;
+    const options& _opts;
+    frame_pool _pool;
+    std::vector<std::unique_ptr<client>> _clients; // destroyed before the pool their frames come from
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>> _timers;
+    std::unique_ptr<process> _think;
+    duration<double> _now;
+    unsigned long _generated;
+
+public:
+    using script = client::task (*)(client&);
+
+    script_engine(unsigned long clients, request_sink& rt, script fn, const options& opts, random_stream think, reactor* r = nullptr, key_generator* keys = nullptr)
+            : _sink(rt)
+            , _reactor(r)
+            , _keys(keys)
+            , _opts(opts)
+            , _think(make_process(opts.get("think-process", std::string("poisson")), duration<double, std::micro>(opts.get("think", 1000.0)), think))
+            , _now(0.0)
+            , _generated(0)
+    {
+        _clients.reserve(clients);
+        for (unsigned long i = 0; i < clients; i++) {
+            _clients.push_back(std::make_unique<client>(*this));
+            fn(*_clients.back());
+        }
+    }
+
+    virtual void tick(duration<double> now) override {
+        while (!_timers.empty() && _timers.top().first <= now) {
+            auto [at, h] = _timers.top();
+            _timers.pop();
+            _now = at;
+            h.resume();
+        }
+    }
+
+    void issue(client::issue_awaiter& w) {
+        w.clock = &_now;
+        unsigned long key = _keys ? _keys->get() : 0;
+        if (_reactor) {
+            _reactor->submit(_now, key, &w);
+        } else {
+            _sink.queue(_now, key, &w);
+        }
+        _generated++;
+    }
+
+    void sleep(duration<double> d, std::coroutine_handle<> h) {
+        _timers.emplace(_now + d, h);
+    }
+
+    duration<double> think() { return _think->get(); }
+    const options& opts() const noexcept { return _opts; }
+    frame_pool& pool() noexcept { return _pool; }
+    virtual unsigned long generated() const noexcept override { return _generated; }
+    unsigned long frames() const noexcept { return _pool.allocated(); }
+};
+
+inline void client::issue_awaiter::await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    c._engine.issue(*this);
+}
+
+inline void client::sleep_awaiter::await_suspend(std::coroutine_handle<> h) {
+    c._engine.sleep(d, h);
+}
+
+inline duration<double> client::think() { return _engine.think(); }
+inline const options& client::opts() const noexcept { return _engine.opts(); }
+inline frame_pool& client::pool() { return _engine.pool(); }
+
+// Closed-loop client, issues a request, thinks, repeats. Clients start at a
+// random point of the think time so that they don't march in lockstep
+static client::task closed_client(client& c) {
+    co_await c.sleep(c.think());
+    for (;;) {
+        co_await c.issue();
+        co_await c.sleep(c.think());
+    }
+}
+
+// Session client, issues a chain of --chain dependent requests, retrying the
+// ones that took longer than --timeout usec up to --retries times
+static client::task session_client(client& c) {
+    unsigned chain = c.opts().get("chain", 3.0);
+    unsigned retries = c.opts().get("retries", 2.0);
+    duration<double> timeout = duration<double, std::micro>(c.opts().get("timeout", 0.0));
+
+    co_await c.sleep(c.think());
+    for (;;) {
+        for (unsigned i = 0; i < chain; i++) {
+            for (unsigned attempt = 0; attempt <= retries; attempt++) {
+                auto lat = co_await c.issue();
+                if (timeout.count() == 0.0 || lat <= timeout) {
+                    break;
+                }
+            }
+        }
+        co_await c.sleep(c.think());
+    }
+}
+
+static script_engine::script find_script(std::string name) {
+    if (name == "closed") {
+        return closed_client;
+    }
+    if (name == "session") {
+        return session_client;
+    }
+
+    throw std::runtime_error(fmt::format("unknown script {}", name));
+}
+
+// Shows where the simulator's own time goes: with --self-profile the main
+// loop parts are timed with the cycle counter. Only one tick in 64 is
+// timed to keep the overhead low. Built with -DSELF_PROFILE=0 the accounting
+// compiles to nothing
+class self_profile {
+public:
+    enum part { consumers, routing, producer, cache, stealing, dispatchers, reactor, bookkeeping, nr_parts };
+
+private:
+    static constexpr std::array<const char*, nr_parts> names = {
+        "consumers", "routing", "producer", "cache", "stealing", "dispatchers", "reactor", "bookkeeping",
+    };
+
+    static constexpr unsigned long sample_every = 64;
+
+    const bool _on;
+    bool _timing = false;
+    std::array<unsigned long, nr_parts> _cycles = {};
+    unsigned long _last = 0;
+    unsigned long _ticks = 0;
+    unsigned long _peak_memory = 0;
+
+    static unsigned long cycles() noexcept {
+#if defined(__x86_64__)
+        return __rdtsc();
+#else
+        return steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+public:
+    explicit self_profile(bool on) : _on(SELF_PROFILE && on) {}
+
+    bool on() const noexcept { return SELF_PROFILE && _on; }
+
+    void tick() noexcept {
+        if (on()) {
+            _timing = _ticks++ % sample_every == 0;
+            if (_timing) {
+                _last = cycles();
+            }
+        }
+    }
+
+    // Charges the cycles since the previous call to the part
+    void account(part p) noexcept {
+        if (on() && _timing) {
+            auto now = cycles();
+            _cycles[p] += now - _last;
+            _last = now;
+        }
+    }
+
+    bool sample_memory() const noexcept { return on() && _ticks % 1000 == 0; }
+    void memory(unsigned long bytes) noexcept { _peak_memory = std::max(_peak_memory, bytes); }
+
+    void report(duration<double> wall, unsigned long arrivals, unsigned long polls, unsigned long dispatches, unsigned long completions) const {
+        if (!on()) {
+            return;
+        }
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        unsigned long events = arrivals + polls + dispatches + completions;
+        fmt::print("self-profile: wall {:.3f}s  ticks {}  events {} ({:.0f}/s)  peak RSS {}KB  peak queue memory {}KB\n", wall.count(),
+                _ticks, events, events / wall.count(), ru.ru_maxrss, _peak_memory / 1024);
+        fmt::print("self-profile: arrivals {}  polls {}  dispatches {}  completions {}\n", arrivals, polls, dispatches, completions);
+        unsigned long total = std::max(std::accumulate(_cycles.begin(), _cycles.end(), 0ul), 1ul);
+        std::string parts;
+        for (unsigned p = 0; p < nr_parts; p++) {
+            if (_cycles[p] != 0) {
+                parts += fmt::format("  {} {:.1f}%", names[p], _cycles[p] * 100.0 / total);
+            }
+        }
+        fmt::print("self-profile: cycles/tick {:.0f}{}\n", double(total) / std::max((_ticks + sample_every - 1) / sample_every, 1ul), parts);
+    }
+};
+
+// Watches the dispatcher backlog across device stalls and slowdowns and
+// measures how long it takes for it to drain back to the pre-stall level
+class drain_tracker {
+    struct episode {
+        duration<double> start;
+        duration<double> end;
+        duration<double> drained;
+        unsigned long queued;
+        unsigned long peak;
+        bool stall;
+    };
+
+    std::vector<episode> _episodes;
+    bool _disturbed = false;
+    bool _draining = false;
+
+public:
+    void tick(duration<double> now, double speed, unsigned long queued) {
+        if (speed < 1.0) {
+            if (!_disturbed) {
+                _draining = false;
+                _disturbed = true;
+                _episodes.push_back(episode{now, now, duration<double>::max(), queued, queued, false});
+            }
+            _episodes.back().stall |= speed == 0.0;
+        } else if (_disturbed) {
+            _disturbed = false;
+            _draining = true;
+            _episodes.back().end = now;
+        }
+
+        if (_episodes.empty()) {
+            return;
+        }
+
+        episode& e = _episodes.back();
+        e.peak = std::max(e.peak, queued);
+        if (_draining && queued <= e.queued) {
+            _draining = false;
+            e.drained = now - e.end;
+        }
+    }
+
+    void report() const {
+        for (auto& e : _episodes) {
+            if (e.drained != duration<double>::max()) {
+                fmt::print("{} at {:.6f} for {:.6f}: queued {} peak {} drained in {:.6f}\n", e.stall ? "stall" : "slowdown",
+                        e.start.count(), (e.end - e.start).count(), e.queued, e.peak, e.drained.count());
+            } else {
+                fmt::print("{} at {:.6f} for {:.6f}: queued {} peak {} not drained\n", e.stall ? "stall" : "slowdown",
+                        e.start.count(), (e.end - e.start).count(), e.queued, e.peak);
+            }
+        }
+    }
+};
+
+// Emulation runs producer, dispatcher and consumer as real threads pinned
+// to cores and connected with lock-free rings, so that the dispatcher's own
+// CPU cost and the cross-core hand-off latencies are real
+
+// Single-producer single-consumer ring, head and tail live on their own cache lines
+template <typename T>
+class spsc_ring {
+    struct alignas(T) slot {
+        unsigned char data[sizeof(T)];
+    };
+
+    std::vector<slot> _slots;
+    const unsigned long _mask;
+    alignas(64) std::atomic<unsigned long> _head;
+    alignas(64) std::atomic<unsigned long> _tail;
+
+public:
+    explicit spsc_ring(unsigned long size) : _slots(size), _mask(size - 1), _head(0), _tail(0) {
+        if ((size & _mask) != 0) {
+            throw std::runtime_error("ring size must be power of two");
+        }
+    }
+
+    ~spsc_ring() {
+        while (pop()) ;
+    }
+
+    bool push(T&& v) {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) > _mask) {
+            return false;
+        }
+        new (_slots[tail & _mask].data) T(std::move(v));
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> pop() {
+        auto head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        T* p = reinterpret_cast<T*>(_slots[head & _mask].data);
+        std::optional<T> ret(std::move(*p));
+        p->~T();
+        _head.store(head + 1, std::memory_order_release);
+        return ret;
+    }
+};
+
+static void pin_thread(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % std::thread::hardware_concurrency(), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Dispatcher's view of the consumer running on another core
+// The pool belongs to the dispatcher thread, the consumer thread only gets
+// the handle and a copy of the dispatch time
+struct remote_request {
+    request_pool::handle rq;
+    duration<double> dispatch;
+};
+
+class remote_consumer : public executor {
+    spsc_ring<remote_request>& _to;
+    spsc_ring<remote_request>& _from;
+    collector& _st;
+    const duration<double> _lat;
+    unsigned long _executing;
+
+public:
+    remote_consumer(request_pool& pool, spsc_ring<remote_request>& to, spsc_ring<remote_request>& from, collector& st, unsigned rps)
+            : executor(pool)
+            , _to(to)
+            , _from(from)
+            , _st(st)
+            , _lat(1.0 / rps)
+            , _executing(0)
+    {
+    }
+
+    virtual void execute(duration<double> now, request_pool::handle rq) override {
+        _pool.dispatch(rq) = now;
+        while (!_to.push(remote_request{rq, now})) {
+            cpu_relax();
+        }
+        _executing++;
+    }
+
+    virtual void reap(duration<double> now) override {
+        while (auto r = _from.pop()) {
+            _st.collect(now - _pool.start(r->rq), now - r->dispatch);
+            _executing--;
+            notify(now, r->rq);
+        }
+    }
+
+    virtual duration<double> latency() const noexcept override { return _lat; }
+    virtual unsigned long executing() const noexcept override { return _executing; }
+};
+
+struct handoff {
+    duration<double> total = duration<double>(0.0);
+    duration<double> max = duration<double>(0.0);
+    unsigned long count = 0;
+
+    void add(duration<double> d) noexcept {
+        total += d;
+        max = std::max(max, d);
+        count++;
+    }
+
+    duration<double> mean() const noexcept { return count ? total / count : total; }
+};
+
+static int emulate(unsigned long total_sec, std::string prod_proc, unsigned long prod_rate, std::string disp_proc,
+        std::string cons_proc, unsigned long cons_rate, unsigned latency_goal, float goal_factor, unsigned long limit,
+        std::string policy_name, std::string policy_args, bool spin, std::vector<unsigned long> cpus, uint64_t seed)
+{
+    if (disp_proc == "reactor" || cons_proc == "profile" || cons_proc == "uring") {
+        throw std::runtime_error("emulation needs pause processes");
+    }
+
+    spsc_ring<duration<double>> arrivals(1 << 16);
+    spsc_ring<remote_request> dispatches(1 << 16), completions(1 << 16);
+    std::atomic<bool> stop(false);
+    auto start = steady_clock::now();
+    auto clock = [start] { return duration<double>(steady_clock::now() - start); };
+    auto wait_until = [&clock, spin] (duration<double> t) {
+        if (!spin) {
+            std::this_thread::sleep_for(t - clock());
+        }
+        while (clock() < t) {
+            cpu_relax();
+        }
+    };
+
+    collector st;
+    request_pool pool;
+    remote_consumer remote(pool, dispatches, completions, st, cons_rate);
+    dispatcher disp(pool, microseconds(latency_goal), remote, disp_proc, make_stream(seed, stream::pause), goal_factor, limit, policy_name, policy_args);
+    unsigned long generated = 0, dropped = 0, served = 0, max_queued = 0;
+    duration<double> disp_busy(0.0);
+    handoff to_disp, to_cons;
+
+    std::thread prod_thread([&] {
+        pin_thread(cpus[0]);
+        auto pause = make_process(prod_proc, duration<double>(1.0 / prod_rate), make_stream(seed, stream::arrivals));
+        duration<double> next(0.0);
+        while (!stop.load(std::memory_order_relaxed)) {
+            wait_until(next);
+            if (arrivals.push(clock())) {
+                generated++;
+            } else {
+                dropped++;
+            }
+            next += pause->get();
+        }
+    });
+
+    std::thread cons_thread([&] {
+        pin_thread(cpus[2]);
+        auto pause = make_process(cons_proc, duration<double>(1.0 / cons_rate), make_stream(seed, stream::service));
+        duration<double> next(0.0);
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto rq = dispatches.pop();
+            if (!rq) {
+                cpu_relax();
+                continue;
+            }
+            auto now = clock();
+            to_cons.add(now - rq->dispatch);
+            next = std::max(next, now) + pause->get();
+            wait_until(next);
+            while (!completions.push(std::move(*rq))) {
+                cpu_relax();
+            }
+            served++;
+        }
+    });
+
+    pin_thread(cpus[1]);
+    for (auto now = clock(); now <= seconds(total_sec); now = clock()) {
+        while (auto start = arrivals.pop()) {
+            to_disp.add(clock() - *start);
+            disp.queue(*start);
+        }
+        // Only the tick is the dispatcher's work, taking arrivals in is not
+        auto tick_start = clock();
+        auto dispatched = disp.dispatched();
+        disp.tick(tick_start);
+        if (disp.dispatched() != dispatched) {
+            disp_busy += clock() - tick_start;
+        }
+        max_queued = std::max(max_queued, disp.queued());
+    }
+    stop.store(true);
+    prod_thread.join();
+    cons_thread.join();
+
+    fmt::print("producer rate: {} consumer rate: {} maximum queued: {} executing: {}\n", prod_rate, cons_rate, max_queued, remote.executing());
+    fmt::print("total latencies: mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n", st.mean_lat().count(), st.p95_lat().count(), st.p99_lat().count(), st.max_lat().count());
+    fmt::print("exec latencies:  mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n", st.mean_xlat().count(), st.p95_xlat().count(), st.p99_xlat().count(), st.max_xlat().count());
+    fmt::print("emulation: generated {} dropped {} dispatched {} served {}  dispatch cost {:.3f}us/request\n",
+            generated, dropped, disp.dispatched(), served, disp_busy.count() * 1000000 / std::max(disp.dispatched(), 1ul));
+    fmt::print("hand-offs:       producer->dispatcher mean {:.6f} max {:.6f}  dispatcher->consumer mean {:.6f} max {:.6f}\n",
+            to_disp.mean().count(), to_disp.max.count(), to_cons.mean().count(), to_cons.max.count());
+    return 0;
+}
+
+// Fluid engine for very high rates: instead of requests it moves amounts of
+// work. Cumulative arrivals and completions are diffusions, the mean rate
+// plus gaussian noise with the process variance, advanced in fixed steps.
+// The dispatcher polls as the exact one does, topping the executing amount
+// up to the limit. Work is served in order, so the latency of the work that
+// arrived (or was dispatched) at some time is how long completions take to
+// catch up with it
+class fluid_queue {
+    struct slice {
+        double level; // cumulative amount up to the end of the slice
+        double amount;
+        duration<double> at;
+    };
+
+    std::deque<slice> _slices;
+    double _level = 0.0;
+    histogram _hist;
+
+public:
+    void push(duration<double> at, double amount) {
+        if (amount > 0.0) {
+            _level += amount;
+            _slices.push_back(slice{_level, amount, at});
+        }
+    }
+
+    // Completions went from done to done + amount by now
+    void complete(duration<double> now, double done, double amount) {
+        double upto = done + amount;
+        while (!_slices.empty()) {
+            auto& s = _slices.front();
+            double from = std::max(s.level - s.amount, done);
+            double to = std::min(s.level, upto);
+            if (to > from) {
+                _hist.add(duration_cast<nanoseconds>(now - s.at), to - from);
+            }
+            if (s.level > upto) {
+                break;
+            }
+            _slices.pop_front();
+        }
+    }
+
+    double level() const noexcept { return _level; }
+    const histogram& hist() const noexcept { return _hist; }
+};
+
+static int fluid(unsigned long total_sec, std::string prod_proc, unsigned long prod_rate, std::string disp_proc,
+        std::string cons_proc, unsigned long cons_rate, unsigned latency_goal, float goal_factor, unsigned long limit,
+        duration<double> step, uint64_t seed)
+{
+    if (disp_proc == "reactor" || cons_proc == "profile" || cons_proc == "uring" || prod_proc == "script") {
+        throw std::runtime_error("fluid engine needs pause processes");
+    }
+    if (step.count() <= 0.0) {
+        throw std::runtime_error("fluid step must be positive");
+    }
+
+    auto wall_start = steady_clock::now();
+    auto arrival = moments(prod_proc);
+    auto service = moments(cons_proc);
+    double lambda = prod_rate / arrival.mean;
+    double mu = cons_rate / service.mean;
+    // Same limit as the dispatcher's
+    if (limit == 0) {
+        limit = microseconds(latency_goal) * goal_factor * cons_rate / seconds(1);
+    }
+    if (limit == 0) {
+        throw std::runtime_error("Too low consumer rate");
+    }
+    auto poll = make_process(disp_proc, microseconds(latency_goal), make_stream(seed, stream::pause));
+    auto arrivals_noise = make_stream(seed, stream::arrivals);
+    auto service_noise = make_stream(seed, stream::service);
+
+    fluid_queue total, exec;
+    double dispatched = 0.0;
+    double completed = 0.0;
+    double max_queued = 0.0;
+    double max_executing = 0.0;
+    duration<double> next_poll(0.0);
+    unsigned long steps = 0;
+    // Negative noise is paid off by the next steps instead of being cut off,
+    // which would inflate the rates
+    double arrivals_debt = 0.0;
+    double service_debt = 0.0;
+
+    double dt = step.count();
+    for (duration<double> now(0.0); now <= seconds(total_sec); now += step, steps++) {
+        double a = lambda * dt + std::sqrt(lambda * arrival.scv * dt) * arrivals_noise.next_normal() + arrivals_debt;
+        arrivals_debt = std::min(a, 0.0);
+        total.push(now, std::max(a, 0.0));
+
+        if (now >= next_poll) {
+            next_poll += poll->get();
+            double executing = dispatched - completed;
+            double move = std::min(total.level() - dispatched, std::max(limit - executing, 0.0));
+            dispatched += move;
+            exec.push(now, move);
+        }
+
+        double executing = dispatched - completed;
+        if (executing > 0.0) {
+            double d = mu * dt + std::sqrt(mu * service.scv * dt) * service_noise.next_normal() + service_debt;
+            service_debt = std::min(d, 0.0);
+            d = std::clamp(d, 0.0, executing);
+            total.complete(now + step, completed, d);
+            exec.complete(now + step, completed, d);
+            completed += d;
+        }
+
+        max_queued = std::max(max_queued, total.level() - dispatched);
+        max_executing = std::max(max_executing, dispatched - completed);
+    }
+
+    auto& st = total.hist();
+    auto& xst = exec.hist();
+    fmt::print("producer rate: {} consumer rate: {} maximum queued: {:.0f} executing: {:.0f}\n", prod_rate, cons_rate, max_queued, max_executing);
+    fmt::print("total latencies: mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n",
+            st.mean() / 1e6, st.quantile(0.95) / 1e6, st.quantile(0.99) / 1e6, st.max() / 1e6);
+    fmt::print("exec latencies:  mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n",
+            xst.mean() / 1e6, xst.quantile(0.95) / 1e6, xst.quantile(0.99) / 1e6, xst.max() / 1e6);
+    fmt::print("fluid: steps {}  step {:.1f}us  completed {:.0f}  wall time {:.1f}ms\n", steps, dt * 1e6, completed,
+            duration<double, std::milli>(steady_clock::now() - wall_start).count());
+    return 0;
+}
+
+// Aggregated-flow engine: the same ticks and the same processes drawing
+// the same numbers as the exact engine, but requests that arrived on the same
+// tick are one bucket with a count and move through the queues together,
+// split when only some of them get dispatched. Latencies are collected once
+// per bucket weighted by its count, so the result is the exact engine's
+// (up to the histogram precision) for a single consumer with a pause process
+static int flow(unsigned long total_sec, std::string prod_proc, unsigned long prod_rate, std::string disp_proc,
+        std::string cons_proc, unsigned long cons_rate, unsigned latency_goal, float goal_factor, unsigned long limit,
+        uint64_t seed)
+{
+    if (disp_proc == "reactor" || cons_proc == "profile" || cons_proc == "uring" || prod_proc == "script") {
+        throw std::runtime_error("flow engine needs pause processes");
+    }
+
+    struct bucket {
+        duration<double> start;
+        duration<double> dispatch;
+        unsigned long count;
+    };
+
+    auto wall_start = steady_clock::now();
+    duration<double> lat = microseconds(latency_goal);
+    if (limit == 0) {
+        limit = lat * goal_factor / duration<double>(1.0 / cons_rate);
+    }
+    if (limit == 0) {
+        throw std::runtime_error("Too low consumer rate");
+    }
+    auto arrival = make_process(prod_proc, duration<double>(1.0 / prod_rate), make_stream(seed, stream::arrivals));
+    auto poll = make_process(disp_proc, lat, make_stream(seed, stream::pause));
+    auto service = make_process(cons_proc, duration<double>(1.0 / cons_rate), make_stream(seed, stream::service));
+
+    std::deque<bucket> queue, executing;
+    unsigned long queued = 0, inflight = 0, max_queued = 0, max_executed = 0, buckets = 0;
+    duration<double> next_arrival(0.0), next_poll(0.0), next_completion(0.0);
+    histogram st, xst;
+
+    duration<double> now(0.0);
+    while (now <= seconds(total_sec)) {
+        auto complete = [&] (bucket& b, unsigned long n) {
+            st.add(duration_cast<nanoseconds>(now - b.start), n);
+            xst.add(duration_cast<nanoseconds>(now - b.dispatch), n);
+            b.count -= n;
+        };
+        unsigned long done = 0;
+        while (inflight > 0 && now >= next_completion) {
+            next_completion += service->get();
+            inflight--;
+            if (++done == executing.front().count) {
+                complete(executing.front(), done);
+                executing.pop_front();
+                done = 0;
+            }
+        }
+        if (done > 0) {
+            complete(executing.front(), done);
+        }
+
+        unsigned long arrived = 0;
+        while (now >= next_arrival) {
+            next_arrival += arrival->get();
+            arrived++;
+        }
+        if (arrived > 0) {
+            queue.push_back(bucket{now, duration<double>(0.0), arrived});
+            queued += arrived;
+            buckets++;
+        }
+
+        if (now >= next_poll) {
+            next_poll += poll->get();
+            unsigned long allowed = inflight >= limit ? 0 : limit - inflight;
+            while (queued > 0 && allowed > 0) {
+                auto& b = queue.front();
+                unsigned long n = std::min(b.count, allowed);
+                if (inflight == 0) {
+                    next_completion = now + service->get();
+                }
+                if (!executing.empty() && executing.back().start == b.start && executing.back().dispatch == now) {
+                    executing.back().count += n;
+                } else {
+                    executing.push_back(bucket{b.start, now, n});
+                }
+                inflight += n;
+                queued -= n;
+                allowed -= n;
+                if ((b.count -= n) == 0) {
+                    queue.pop_front();
+                }
+            }
+        }
+
+        max_queued = std::max(max_queued, queued);
+        max_executed = std::max(max_executed, inflight);
+        now += microseconds(1);
+    }
+
+    fmt::print("producer rate: {} consumer rate: {} maximum queued: {} executing: {}\n", prod_rate, cons_rate, max_queued, max_executed);
+    fmt::print("total latencies: mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n",
+            st.mean() / 1e6, st.quantile(0.95) / 1e6, st.quantile(0.99) / 1e6, st.max() / 1e6);
+    fmt::print("exec latencies:  mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n",
+            xst.mean() / 1e6, xst.quantile(0.95) / 1e6, xst.quantile(0.99) / 1e6, xst.max() / 1e6);
+    fmt::print("flow: buckets {}  completed {:.0f}  wall time {:.1f}ms\n", buckets, st.total(),
+            duration<double, std::milli>(steady_clock::now() - wall_start).count());
+    return 0;
+}
+
+static int simulate(int argc, char **argv);
+
+// Profiles are parsed once per worker and kept until the file changes
+static std::shared_ptr<const device_profile> load_profile(std::string path, std::string op, unsigned long size) {
+    static std::map<std::tuple<std::string, std::string, unsigned long>, std::pair<timespec, std::shared_ptr<const device_profile>>> cache;
+    struct stat st = {};
+    stat(path.c_str(), &st);
+    auto& [mtime, profile] = cache[{ path, op, size }];
+    if (!profile || mtime.tv_sec != st.st_mtim.tv_sec || mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        profile = std::make_shared<const device_profile>(device_profile::load(path, op, size));
+        mtime = st.st_mtim;
+    }
+    return profile;
+}
+
+// Batch workers are forked once and run the scenarios they are sent one
+// after another, so many short runs pay for the process startup only once.
+// A worker's output goes to a pipe and ends with a record separator line
+static constexpr std::string_view end_of_result = "\x1e\n";
+
+struct batch_worker {
+    pid_t pid = -1;
+    int to = -1;
+    int from = -1;
+    std::string id; // of the scenario it runs, empty when idle
+    std::string output;
+    unsigned long client = 0; // the scenario came from, in server mode
+    std::string key; // of the scenario in the result cache
+    double cost = 0.0; // of the scenario in simulated seconds
+};
+
+// The options given to all scenarios go between a scenario's positional
+// arguments and its own options, so the scenario's own ones win
+static std::vector<std::string> with_common(std::vector<std::string> args, const std::vector<std::string>& common) {
+    auto opts = std::find_if(args.begin(), args.end(), [] (const std::string& arg) { return arg.rfind("--", 0) == 0; });
+    args.insert(opts, common.begin(), common.end());
+    return args;
+}
+
+static void run_worker(int in, std::vector<std::string> common) {
+    FILE* f = fdopen(in, "r");
+    char* line = nullptr;
+    size_t size = 0;
+    while (getline(&line, &size, f) > 0) {
+        std::vector<std::string> args = { "sim" };
+        std::stringstream ss(line);
+        for (std::string arg; ss >> arg;) {
+            args.push_back(arg);
+        }
+        args = with_common(std::move(args), common);
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+        try {
+            simulate(args.size(), argv.data());
+        } catch (std::exception& e) {
+            fmt::print("error: {}\n", e.what());
+        }
+        fmt::print("{}", end_of_result);
+        fflush(stdout);
+    }
+    _exit(0);
+}
+
+static batch_worker start_worker(const std::vector<std::string>& common) {
+    int to[2], from[2];
+    if (pipe(to) < 0 || pipe(from) < 0) {
+        throw std::runtime_error(fmt::format("cannot create pipe: {}", strerror(errno)));
+    }
+    fflush(stdout);
+    batch_worker w;
+    w.pid = fork();
+    if (w.pid < 0) {
+        throw std::runtime_error(fmt::format("cannot fork: {}", strerror(errno)));
+    }
+    if (w.pid == 0) {
+        // Other workers and clients only see their pipes and sockets closed
+        // when no one else holds them
+        dup2(to[0], STDIN_FILENO);
+        dup2(from[1], STDOUT_FILENO);
+        close_range(STDERR_FILENO + 1, ~0u, 0);
+        run_worker(STDIN_FILENO, common);
+    }
+    close(to[0]);
+    close(from[1]);
+    w.to = to[1];
+    w.from = from[0];
+    return w;
+}
+
+// Replaces the worker's process, what it was running is left to the caller
+static void restart_worker(batch_worker& w, const std::vector<std::string>& common) {
+    close(w.to);
+    close(w.from);
+    waitpid(w.pid, nullptr, 0);
+    auto fresh = start_worker(common);
+    w.pid = fresh.pid;
+    w.to = fresh.to;
+    w.from = fresh.from;
+}
+
+// A worker that died while idle and was not noticed yet is replaced before
+// it gets the scenario
+static void send_scenario(batch_worker& w, std::string line, const std::vector<std::string>& common) {
+    std::stringstream ss(line);
+    std::string id;
+    ss >> id;
+    std::string args;
+    std::getline(ss, args);
+    args += '\n';
+    for (bool retried = false;; retried = true) {
+        if (write(w.to, args.data(), args.size()) == ssize_t(args.size())) {
+            break;
+        }
+        if (errno != EPIPE || retried) {
+            throw std::runtime_error(fmt::format("cannot send scenario {}: {}", id, strerror(errno)));
+        }
+        restart_worker(w, common);
+    }
+    w.id = id;
+}
+
+// One row per scenario, its output lines joined
+static std::string result_row(std::string_view id, std::string_view output) {
+    std::string row(id);
+    for (size_t pos = 0; pos < output.size();) {
+        auto eol = output.find('\n', pos);
+        if (eol == std::string_view::npos) {
+            eol = output.size();
+        }
+        row += row.size() == id.size() ? " " : " | ";
+        row += output.substr(pos, eol - pos);
+        pos = eol + 1;
+    }
+    return row + '\n';
+}
+
+static void print_result(std::string_view id, std::string_view output) {
+    fmt::print("{}", result_row(id, output));
+    fflush(stdout);
+}
+
+// Scenario lines are an ID followed by the usual arguments, the options on
+// the batch command line apply to all of them. Results are printed as the
+// scenarios complete, so they can come out of order
+static int batch(std::string path, unsigned nr_workers, std::vector<std::string> common) {
+    int input = path.empty() || path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (input < 0) {
+        throw std::runtime_error(fmt::format("cannot open {}: {}", path, strerror(errno)));
+    }
+    if (nr_workers == 0) {
+        throw std::runtime_error("need at least one worker");
+    }
+    std::vector<batch_worker> workers;
+    for (unsigned i = 0; i < nr_workers; i++) {
+        workers.push_back(start_worker(common));
+    }
+
+    std::string pending;
+    bool eof = false;
+    // Next scenario line, skipping empty ones and comments
+    auto next_line = [&] () -> std::optional<std::string> {
+        for (;;) {
+            auto eol = pending.find('\n');
+            if (eol == std::string::npos && !(eof && !pending.empty())) {
+                return std::nullopt;
+            }
+            auto line = pending.substr(0, eol);
+            pending.erase(0, eol == std::string::npos ? pending.size() : eol + 1);
+            auto first = line.find_first_not_of(" \t");
+            if (first != std::string::npos && line[first] != '#') {
+                return line;
+            }
+        }
+    };
+
+    for (;;) {
+        for (auto& w : workers) {
+            if (w.id.empty()) {
+                if (auto line = next_line()) {
+                    send_scenario(w, *line, common);
+                }
+            }
+        }
+        bool busy = std::any_of(workers.begin(), workers.end(), [] (auto& w) { return !w.id.empty(); });
+        bool idle = std::any_of(workers.begin(), workers.end(), [] (auto& w) { return w.id.empty(); });
+        if (eof && !busy) {
+            break;
+        }
+
+        std::vector<pollfd> fds;
+        for (auto& w : workers) {
+            fds.push_back(pollfd{ w.from, short(w.id.empty() ? 0 : POLLIN), 0 });
+        }
+        fds.push_back(pollfd{ input, short(eof || !idle ? 0 : POLLIN), 0 });
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(fmt::format("poll failed: {}", strerror(errno)));
+        }
+
+        if (fds.back().revents) {
+            char buf[4096];
+            auto n = read(input, buf, sizeof(buf));
+            if (n <= 0) {
+                eof = true;
+            } else {
+                pending.append(buf, n);
+            }
+        }
+        for (unsigned i = 0; i < workers.size(); i++) {
+            auto& w = workers[i];
+            if (!fds[i].revents) {
+                continue;
+            }
+            // Idle workers have nothing to say, they hung up
+            if (w.id.empty()) {
+                restart_worker(w, common);
+                continue;
+            }
+            char buf[4096];
+            auto n = read(w.from, buf, sizeof(buf));
+            if (n > 0) {
+                w.output.append(buf, n);
+                if (w.output.ends_with(end_of_result)) {
+                    w.output.resize(w.output.size() - end_of_result.size());
+                    print_result(w.id, w.output);
+                    w.id.clear();
+                    w.output.clear();
+                }
+                continue;
+            }
+            // The scenario took the worker down, a new one takes its place
+            print_result(w.id, w.output + "error: worker died");
+            w.id.clear();
+            w.output.clear();
+            restart_worker(w, common);
+        }
+    }
+
+    for (auto& w : workers) {
+        close(w.to);
+        close(w.from);
+        waitpid(w.pid, nullptr, 0);
+    }
+    if (input != STDIN_FILENO) {
+        close(input);
+    }
+    return 0;
+}
+
+// Results of seeded runs that do not depend on the wall clock are the same
+// every time, the server answers repeated questions from memory. Runs that
+// write flight dumps or a stats page are always run, the files are what they
+// are asked for. Runs that read a profile or load a policy are the same only
+// while those files are, so their modification times are part of the key
+class result_cache {
+    const unsigned long _capacity;
+    std::list<std::pair<std::string, std::string>> _lru;
+    std::unordered_map<std::string, decltype(_lru)::iterator> _index;
+
+public:
+    result_cache(unsigned long capacity) : _capacity(capacity) {}
+
+    // Empty if the run cannot be cached
+    static std::string key(const std::vector<std::string>& args) {
+        bool seeded = false;
+        std::string key = fmt::format("{}", fmt::join(args, " "));
+        for (auto& arg : args) {
+            seeded |= arg.rfind("--seed=", 0) == 0;
+            if (arg == "uring" || arg.rfind("--file", 0) == 0 || arg.rfind("--emulate", 0) == 0 ||
+                    arg.rfind("--wall-budget", 0) == 0 || arg == "--self-profile" ||
+                    arg.rfind("--record-", 0) == 0 || arg.rfind("--stats", 0) == 0) {
+                return std::string();
+            }
+            std::string path;
+            if (arg.rfind("--profile=", 0) == 0) {
+                path = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--policy=", 0) == 0) {
+                path = policy_path(arg.substr(arg.find('=') + 1));
+            }
+            if (!path.empty()) {
+                struct stat st;
+                if (stat(path.c_str(), &st) < 0) {
+                    return std::string();
+                }
+                key += fmt::format(" {}@{}.{}", path, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+            }
+        }
+        return seeded ? key : std::string();
+    }
+
+    const std::string* find(const std::string& key) {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            return nullptr;
+        }
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return &it->second->second;
+    }
+
+    void insert(std::string key, std::string output) {
+        if (_capacity == 0 || _index.contains(key)) {
+            return;
+        }
+        _lru.emplace_front(key, std::move(output));
+        _index[std::move(key)] = _lru.begin();
+        if (_lru.size() > _capacity) {
+            _index.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+    }
+};
+
+// Connection to the server, its scenarios wait in its own queue and its
+// results in its own buffer, so a client that does not read only stalls
+// itself
+struct server_client {
+    int fd = -1;
+    std::string pending = {};
+    std::deque<std::string> queue = {};
+    std::string out = {};
+    double served = 0.0; // simulated seconds dispatched, for fairness
+    double running_cost = 0.0; // of them still running
+    unsigned running = 0;
+    unsigned long picked = 0; // when it last got a worker, breaks ties
+    bool eof = false;
+    bool gone = false; // nothing can be sent to it any more
+};
+
+// Serves what-if questions on a Unix socket: clients send scenario lines
+// like in batch mode and get result rows back as the scenarios complete.
+// Idle workers take the next scenario of the client that has been served
+// the fewest simulated seconds so far. New clients start level with what the
+// least served one had before its running scenarios, rather than with a
+// backlog of credit, and win ties. Nothing preempts a running scenario, so
+// runs of up to quick simulated seconds and longer ones each get up to
+// nr_workers workers of their own. When all workers are busy an extra one
+// is forked, and extras are retired once idle, so quick questions never
+// wait for long runs to complete
+static int serve(std::string path, unsigned nr_workers, std::vector<std::string> common, unsigned long cache_size, double quick) {
+    if (nr_workers == 0) {
+        throw std::runtime_error("need at least one worker");
+    }
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty()) {
+        throw std::runtime_error("need a socket path");
+    }
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error(fmt::format("socket path too long: {}", path));
+    }
+    strcpy(addr.sun_path, path.c_str());
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+        throw std::runtime_error(fmt::format("cannot listen on {}: {}", path, strerror(errno)));
+    }
+
+    std::vector<batch_worker> workers;
+    for (unsigned i = 0; i < nr_workers; i++) {
+        workers.push_back(start_worker(common));
+    }
+    fmt::print(stderr, "serving on {} with {} workers\n", path, nr_workers);
+
+    result_cache results(cache_size);
+    std::map<unsigned long, server_client> clients;
+    unsigned long next_client = 1;
+    unsigned long picks = 0;
+
+    // Queued scenarios and unsent results of a client that is gone are
+    // dropped, it is closed once its running scenarios complete
+    auto drop = [] (server_client& c) {
+        c.queue.clear();
+        c.out.clear();
+        c.eof = true;
+        c.gone = true;
+    };
+
+    auto flush = [&] (server_client& c) {
+        while (!c.out.empty()) {
+            auto n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    drop(c);
+                }
+                return;
+            }
+            c.out.erase(0, n);
+        }
+    };
+
+    auto reply = [&] (unsigned long id, std::string_view row) {
+        auto it = clients.find(id);
+        if (it != clients.end() && !it->second.gone) {
+            it->second.out += row;
+            flush(it->second);
+        }
+    };
+
+    auto split = [&] (const std::string& line) {
+        std::stringstream ss(line);
+        std::string id;
+        ss >> id;
+        std::vector<std::string> args;
+        for (std::string arg; ss >> arg;) {
+            args.push_back(arg);
+        }
+        return with_common(std::move(args), common);
+    };
+
+    // Scenario cost in simulated seconds
+    auto cost_of = [&] (const std::string& line) {
+        try {
+            return std::max(std::stod(split(line).at(0)), 1.0);
+        } catch (std::exception&) {
+            return 1.0;
+        }
+    };
+
+    // Least served client whose next scenario is of a class that has a
+    // worker to spare
+    auto least_served = [&] (bool quick_ok, bool long_ok) {
+        auto best = clients.end();
+        for (auto it = clients.begin(); it != clients.end(); ++it) {
+            auto& c = it->second;
+            if (c.queue.empty() || !(cost_of(c.queue.front()) <= quick ? quick_ok : long_ok)) {
+                continue;
+            }
+            if (best == clients.end() || std::tie(c.served, c.picked) < std::tie(best->second.served, best->second.picked)) {
+                best = it;
+            }
+        }
+        return best;
+    };
+
+    for (;;) {
+        for (;;) {
+            unsigned running_quick = 0, running_long = 0;
+            for (auto& w : workers) {
+                if (!w.id.empty()) {
+                    (w.cost <= quick ? running_quick : running_long)++;
+                }
+            }
+            auto it = least_served(running_quick < nr_workers, running_long < nr_workers);
+            if (it == clients.end()) {
+                break;
+            }
+            auto& [client, c] = *it;
+            auto line = std::move(c.queue.front());
+            c.queue.pop_front();
+            auto key = result_cache::key(split(line));
+            if (!key.empty()) {
+                if (auto output = results.find(key)) {
+                    std::stringstream ss(line);
+                    std::string id;
+                    ss >> id;
+                    reply(client, result_row(id, *output));
+                    continue;
+                }
+            }
+            auto w = std::find_if(workers.begin(), workers.end(), [] (auto& w) { return w.id.empty(); });
+            if (w == workers.end()) {
+                workers.push_back(start_worker(common));
+                w = workers.end() - 1;
+            }
+            auto cost = cost_of(line);
+            c.served += cost;
+            c.running_cost += cost;
+            c.running++;
+            c.picked = ++picks;
+            w->client = client;
+            w->key = key;
+            w->cost = cost;
+            send_scenario(*w, line, common);
+        }
+        // Extra workers are not kept around idle
+        for (auto w = workers.begin(); w != workers.end() && workers.size() > nr_workers;) {
+            if (w->id.empty()) {
+                close(w->to);
+                close(w->from);
+                waitpid(w->pid, nullptr, 0);
+                w = workers.erase(w);
+            } else {
+                ++w;
+            }
+        }
+        // Clients are done when they closed their side and got all results
+        std::erase_if(clients, [] (auto& e) {
+            auto& c = e.second;
+            if (c.eof && c.queue.empty() && c.running == 0 && c.out.empty()) {
+                close(c.fd);
+                return true;
+            }
+            return false;
+        });
+
+        std::vector<pollfd> fds;
+        for (auto& w : workers) {
+            fds.push_back(pollfd{ w.from, short(w.id.empty() ? 0 : POLLIN), 0 });
+        }
+        std::vector<unsigned long> polled;
+        for (auto& [id, c] : clients) {
+            if (!c.gone) {
+                fds.push_back(pollfd{ c.fd, short((c.eof ? 0 : POLLIN) | (c.out.empty() ? 0 : POLLOUT)), 0 });
+                polled.push_back(id);
+            }
+        }
+        fds.push_back(pollfd{ listener, POLLIN, 0 });
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(fmt::format("poll failed: {}", strerror(errno)));
+        }
+
+        if (fds.back().revents) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd >= 0) {
+                double level = 0.0;
+                bool first = true;
+                for (auto& [id, c] : clients) {
+                    if (!c.queue.empty() || c.running > 0) {
+                        level = first ? c.served - c.running_cost : std::min(level, c.served - c.running_cost);
+                        first = false;
+                    }
+                }
+                clients[next_client++] = server_client{ .fd = fd, .served = level };
+            }
+        }
+        for (unsigned i = 0; i < polled.size(); i++) {
+            auto& c = clients.at(polled[i]);
+            auto revents = fds[workers.size() + i].revents;
+            if (revents & POLLOUT) {
+                flush(c);
+            }
+            // Hung up altogether rather than just done sending
+            if ((revents & (POLLHUP | POLLERR)) && !(revents & POLLIN)) {
+                drop(c);
+                continue;
+            }
+            if (!(revents & POLLIN)) {
+                continue;
+            }
+            char buf[4096];
+            auto n = read(c.fd, buf, sizeof(buf));
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    drop(c);
+                }
+                continue;
+            }
+            if (n == 0) {
+                c.eof = true;
+                continue;
+            }
+            c.pending.append(buf, n);
+            for (auto eol = c.pending.find('\n'); eol != std::string::npos; eol = c.pending.find('\n')) {
+                auto line = c.pending.substr(0, eol);
+                c.pending.erase(0, eol + 1);
+                auto first = line.find_first_not_of(" \t");
+                if (first != std::string::npos && line[first] != '#') {
+                    c.queue.push_back(line);
+                }
+            }
+        }
+        for (unsigned i = 0; i < workers.size(); i++) {
+            auto& w = workers[i];
+            if (!fds[i].revents) {
+                continue;
+            }
+            // Idle workers have nothing to say, they hung up
+            if (w.id.empty()) {
+                restart_worker(w, common);
+                continue;
+            }
+            auto finish = [&] (std::string_view output) {
+                reply(w.client, result_row(w.id, output));
+                auto it = clients.find(w.client);
+                if (it != clients.end()) {
+                    it->second.running_cost -= w.cost;
+                    it->second.running--;
+                }
+                w.id.clear();
+                w.output.clear();
+            };
+            char buf[4096];
+            auto n = read(w.from, buf, sizeof(buf));
+            if (n > 0) {
+                w.output.append(buf, n);
+                if (w.output.ends_with(end_of_result)) {
+                    w.output.resize(w.output.size() - end_of_result.size());
+                    if (!w.key.empty()) {
+                        results.insert(w.key, w.output);
+                    }
+                    finish(w.output);
+                }
+                continue;
+            }
+            finish(w.output + "error: worker died");
+            restart_worker(w, common);
+        }
+    }
+}
+
+int main (int argc, char **argv)
+{
+    options opts(argc, argv, 1);
+    if (opts.has("batch") || opts.has("serve")) {
+        // Workers that died are noticed when writing to them
+        signal(SIGPIPE, SIG_IGN);
+        std::vector<std::string> common;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--batch", 0) != 0 && arg.rfind("--serve", 0) != 0 && arg.rfind("--workers", 0) != 0 &&
+                    arg.rfind("--result-cache", 0) != 0 && arg.rfind("--quick", 0) != 0) {
+                common.push_back(arg);
+            }
+        }
+        unsigned workers = opts.get("workers", double(std::thread::hardware_concurrency()));
+        if (opts.has("serve")) {
+            // A bare --serve has an empty value
+            auto path = opts.get("serve", std::string());
+            return serve(path.empty() ? "sim.sock" : path, workers, common, opts.get("result-cache", 10000.0), opts.get("quick", 5.0));
+        }
+        return batch(opts.get("batch", std::string()), workers, common);
+    }
+    return simulate(argc, argv);
+}
+
+static int simulate(int argc, char **argv)
+{
+    if (argc < 7) {
+        fmt::print("usage: {} <duration seconds> <producer process> <producer rate> <dispatcher process> <consumer process> <consumer rate> [<latency_goal>] [<goal_factor>] [--option=value ...]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned long total_sec = atoi(argv[1]);
+    std::string prod_proc = argv[2];
+    unsigned long prod_rate = atoi(argv[3]);
+    std::string disp_proc = argv[4];
+    std::string cons_proc = argv[5];
+    unsigned long cons_rate = atoi(argv[6]);
+
+    unsigned latency_goal = 500; // as in seastar
+    if (argc > 7 && argv[7][0] != '-') {
+        latency_goal = atoi(argv[7]);
+    }
+    float goal_factor = 1.5; // as in seastar
+    if (argc > 8 && argv[8][0] != '-') {
+        goal_factor = atof(argv[8]);
+    }
+
+    options opts(argc, argv, 7);
+
+    // Runs with the same seed draw the same numbers
+    static std::random_device rd;
+    uint64_t seed = opts.has("seed") ? std::stoull(opts.get("seed", std::string())) : (uint64_t)rd() << 32 | rd();
+#if VERB
+    fmt::print("Seed {}\n", seed);
+#endif
+
+    if (opts.has("emulate")) {
+        auto mode = opts.get("emulate", std::string());
+        if (mode != "spin" && mode != "sleep") {
+            throw std::runtime_error(fmt::format("unknown emulation mode {}", mode));
+        }
+        std::vector<unsigned long> cpus;
+        std::stringstream cs(opts.get("cpus", std::string("0,1,2")));
+        for (std::string cpu; std::getline(cs, cpu, ',');) {
+            cpus.push_back(std::stoul(cpu));
+        }
+        if (cpus.size() != 3) {
+            throw std::runtime_error("need producer, dispatcher and consumer cpus");
+        }
+        unsigned long limit = opts.get("limit", 0.0);
+        auto policy_name = opts.get("policy", std::string());
+        auto policy_args = opts.get("policy-args", std::string());
+        opts.check();
+        return emulate(total_sec, prod_proc, prod_rate, disp_proc, cons_proc, cons_rate, latency_goal, goal_factor, limit,
+                policy_name, policy_args, mode == "spin", cpus, seed);
+    }
+
+    auto engine = opts.get("engine", std::string("exact"));
+    if (engine == "fluid") {
+        unsigned long limit = opts.get("limit", 0.0);
+        duration<double, std::micro> step(opts.get("fluid-step", 10.0));
+        opts.check();
+        return fluid(total_sec, prod_proc, prod_rate, disp_proc, cons_proc, cons_rate, latency_goal, goal_factor, limit, step, seed);
+    }
+    if (engine == "flow") {
+        unsigned long limit = opts.get("limit", 0.0);
+        opts.check();
+        return flow(total_sec, prod_proc, prod_rate, disp_proc, cons_proc, cons_rate, latency_goal, goal_factor, limit, seed);
+    }
+    if (engine != "exact") {
+        throw std::runtime_error(fmt::format("unknown engine {}", engine));
+    }
+
+    // Every shard is a dispatcher with its own consumer, all alike
+    struct shard {
+        collector st;
+        std::unique_ptr<consumer> cons;
+        std::unique_ptr<dispatcher> disp;
+        unsigned long max_queued = 0;
+
+        shard(collector* total) : st(total) {}
+    };
+
+    collector st;
+    request_pool pool;
+    unsigned long nr_shards = opts.get("consumers", 1.0);
+    if (nr_shards == 0) {
+        throw std::runtime_error("need at least one consumer");
+    }
+    double degrade_factor = opts.get("degrade-factor", 4.0);
+    if (degrade_factor < 1.0) {
+        throw std::runtime_error(fmt::format("bad degrade factor {}", degrade_factor));
+    }
+    auto profile = opts.has("profile") ? load_profile(opts.get("profile", std::string()),
+            opts.get("profile-op", std::string("read")), opts.get("request-size", 4096.0)) : nullptr;
+    std::vector<std::unique_ptr<shard>> shards;
+    std::vector<dispatcher*> dispatchers;
+    std::optional<backlog> shared_queue;
+    if (opts.has("shared-queue")) {
+        shared_queue.emplace(pool);
+    }
+    for (unsigned long i = 0; i < nr_shards; i++) {
+        auto sh = std::make_unique<shard>(&st);
+        sh->cons = std::make_unique<consumer>(pool, cons_rate, sh->st, cons_proc, make_stream(seed, stream::service, i),
+                parse_reaping(opts.get("completion", std::string("instant"))),
+                duration<double, std::micro>(opts.get("wakeup-latency", 10.0)),
+                modulator(opts.get("dwell", std::string("poisson")),
+                        duration<double, std::milli>(opts.get("stall-every", 0.0)),
+                        duration<double, std::milli>(opts.get("stall-time", 10.0)),
+                        duration<double, std::milli>(opts.get("degrade-every", 0.0)),
+                        duration<double, std::milli>(opts.get("degrade-time", 100.0)),
+                        degrade_factor,
+                        parse_faults(opts.get("faults", std::string())), seed, i),
+                profile,
+                opts.has("file") ? std::make_unique<uring_device>(opts.get("file", std::string()), opts.get("request-size", 4096.0),
+                        make_stream(seed, stream::device, i)) : nullptr);
+        sh->disp = std::make_unique<dispatcher>(pool, microseconds(latency_goal), *sh->cons, disp_proc, make_stream(seed, stream::pause, i), goal_factor, opts.get("limit", 0.0),
+                opts.get("policy", std::string()), opts.get("policy-args", std::string()), shared_queue ? &*shared_queue : nullptr);
+        dispatchers.push_back(sh->disp.get());
+        shards.push_back(std::move(sh));
+    }
+
+    // Keys are only drawn when someone needs them
+    unsigned long nr_keys = opts.get("keys", 1000000.0);
+    std::unique_ptr<key_generator> keys;
+    if (nr_shards > 1 || opts.has("key-dist") || opts.has("cache")) {
+        keys = make_keys(opts.get("key-dist", std::string("uniform")), nr_keys, opts.get("zipf", 0.99), opts.get("hotspot", std::string("0.2:0.8")),
+                make_stream(seed, stream::keys));
+    }
+    // Recording only makes sense with something to trigger a dump
+    std::optional<flight_recorder> rec;
+    if (opts.has("record-latency") || opts.has("record-queue")) {
+        rec.emplace(opts.get("record-events", 65536.0), duration<double, std::micro>(opts.get("record-latency", 0.0)),
+                opts.get("record-queue", 0.0), opts.get("record-dump", std::string("flight")), opts.get("record-dumps", 10.0));
+        for (unsigned i = 0; i < shards.size(); i++) {
+            shards[i]->disp->set_recorder(&*rec, i);
+        }
+    }
+    router rt(dispatchers, parse_routing(opts.get("routing", std::string("hash"))), nr_keys, make_stream(seed, stream::routing),
+            duration<double, std::micro>(opts.get("report-period", 0.0)),
+            duration<double, std::micro>(opts.get("report-delay", 0.0)),
+            opts.get("pod-d", 2.0));
+    stealer steal(dispatchers, parse_stealing(opts.get("steal", std::string("off"))),
+            duration<double, std::micro>(opts.get("steal-latency", 5.0)),
+            duration<double, std::micro>(opts.get("steal-cost", 0.1)),
+            opts.get("steal-min", 2.0), make_stream(seed, stream::stealing));
+    if (shared_queue && opts.get("steal", std::string("off")) != "off") {
+        throw std::runtime_error("nothing to steal from a shared queue");
+    }
+    std::optional<cache_stage> cache;
+    if (opts.has("cache")) {
+        cache.emplace(rt, make_cache(opts.get("cache", std::string()), opts.get("cache-size", 100000.0)),
+                duration<double, std::micro>(opts.get("cache-hit-latency", 2.0)), st, pool);
+    }
+    request_sink& sink = cache ? static_cast<request_sink&>(*cache) : rt;
+
+    consumer& cons = *shards[0]->cons;
+    dispatcher& disp = *shards[0]->disp;
+    std::optional<reactor> react;
+    if (disp_proc == "reactor") {
+        if (nr_shards > 1) {
+            throw std::runtime_error("reactor runs one consumer");
+        }
+        react.emplace(sink, disp, cons,
+                duration<double, std::micro>(opts.get("task-quota", 500.0)), // as in seastar
+                duration<double, std::micro>(opts.get("produce-cost", 2.0)),
+                duration<double, std::micro>(opts.get("dispatch-cost", 0.5)),
+                duration<double, std::micro>(opts.get("complete-cost", 0.5)));
+    }
+    // Scripted producer's rate is the number of clients
+    std::unique_ptr<source> prod;
+    if (prod_proc == "script") {
+        prod = std::make_unique<script_engine>(prod_rate, sink, find_script(opts.get("script", std::string("closed"))), opts,
+                make_stream(seed, stream::think), react ? &*react : nullptr, keys.get());
+    } else {
+        prod = std::make_unique<producer>(prod_rate, sink, prod_proc, make_stream(seed, stream::arrivals), react ? &*react : nullptr, keys.get());
+    }
+    // Runs end after the duration or as soon as one of these is reached.
+    // Samples above the quantile q are (1 - q) of the completed ones
+    unsigned long max_completed = opts.get("max-completed", 0.0);
+    unsigned long tail_samples = opts.get("tail-samples", 0.0);
+    double tail_quantile = opts.get("tail-quantile", 0.99);
+    duration<double> wall_budget(opts.get("wall-budget", 0.0));
+    bool bounded = max_completed > 0 || tail_samples > 0 || wall_budget.count() > 0.0;
+    if (tail_quantile <= 0.0 || tail_quantile >= 1.0) {
+        throw std::runtime_error("tail quantile must be between 0 and 1");
+    }
+    auto tail = [&] { return (unsigned long)(st.count() * (1.0 - tail_quantile)); };
+    std::string stopped_by = "duration";
+    unsigned long ticks = 0;
+    self_profile prof(opts.has("self-profile"));
+    stats_writer stats = opts.has("stats") ? stats_writer(opts.get("stats", std::string())) : stats_writer();
+    opts.check();
+    duration<double> _verb(0.0);
+    unsigned long max_queued = 0;
+    unsigned long max_executed = 0;
+    drain_tracker drains;
+
+    // Real device runs in wall-clock time and so does everything else
+    bool realtime = cons_proc == "uring";
+    auto wall_start = steady_clock::now();
+
+    // Live counters for sim-top, published every ten thousand ticks. Rates
+    // are over the time since the previous update
+    double last_now = 0, last_arrivals = 0, last_dispatched = 0, last_processed = 0;
+    unsigned long stats_ticks = 0;
+    auto publish = [&] (duration<double> now, bool done) {
+        // At the end the rates are over the whole run
+        if (done) {
+            last_now = last_arrivals = last_dispatched = last_processed = 0;
+        }
+        stats_values v = {};
+        double arrivals = prod->generated();
+        double dispatched = 0, processed = 0;
+        for (auto& sh : shards) {
+            v.queued += sh->disp->queued();
+            v.executing += sh->cons->executing();
+            dispatched += sh->disp->dispatched();
+            processed += sh->cons->processed();
+        }
+        if (shared_queue) {
+            v.queued = shared_queue->size();
+        }
+        v.now = now.count();
+        v.duration = total_sec;
+        v.wall = duration<double>(steady_clock::now() - wall_start).count();
+        v.events = arrivals + dispatched + processed;
+        if (v.now > last_now) {
+            v.arrival_rate = (arrivals - last_arrivals) / (v.now - last_now);
+            v.dispatch_rate = (dispatched - last_dispatched) / (v.now - last_now);
+            v.completion_rate = (processed - last_processed) / (v.now - last_now);
+        }
+        v.completed = processed;
+        v.mean = st.mean_lat().count() * 1e6;
+        v.p95 = st.p95_lat().count() * 1e6;
+        v.p99 = st.p99_lat().count() * 1e6;
+        v.max = st.max_lat().count() * 1e6;
+        v.done = done;
+        stats.publish(v);
+        last_now = v.now;
+        last_arrivals = arrivals;
+        last_dispatched = dispatched;
+        last_processed = processed;
+    };
+
+    duration<double> now(0.0);
+    while (now <= seconds(total_sec)) {
+        prof.tick();
+        for (auto& sh : shards) {
+            sh->cons->tick(now);
+        }
+        prof.account(self_profile::consumers);
+        rt.tick(now);
+        prof.account(self_profile::routing);
+        prod->tick(now);
+        prof.account(self_profile::producer);
+        if (cache) {
+            cache->tick(now);
+            prof.account(self_profile::cache);
+        }
+        steal.tick(now);
+        prof.account(self_profile::stealing);
+        for (auto& sh : shards) {
+            sh->disp->tick(now);
+        }
+        prof.account(self_profile::dispatchers);
+        if (react) {
+            react->tick(now);
+            prof.account(self_profile::reactor);
+        }
+
+        unsigned long queued = 0;
+        unsigned long executing = 0;
+        double speed = 1.0;
+        for (auto& sh : shards) {
+            sh->max_queued = std::max(sh->max_queued, sh->disp->queued());
+            queued += sh->disp->queued();
+            executing += sh->cons->executing();
+            speed = std::min(speed, sh->cons->speed(now));
+        }
+        if (shared_queue) {
+            queued = shared_queue->size();
+        }
+        drains.tick(now, speed, queued);
+        max_queued = std::max(max_queued, queued);
+        max_executed = std::max(max_executed, executing);
+        if (prof.sample_memory()) {
+            unsigned long memory = pool.memory() + (shared_queue ? shared_queue->memory() : 0);
+            for (auto& sh : shards) {
+                memory += sh->disp->memory();
+            }
+            prof.memory(memory);
+        }
+        if (stats.on() && ++stats_ticks % 10000 == 0) {
+            publish(now, false);
+        }
+        prof.account(self_profile::bookkeeping);
+        if (now >= _verb) {
+#if VERB
+            unsigned long dispatched = 0;
+            unsigned long processed = 0;
+            for (auto& sh : shards) {
+                dispatched += sh->disp->dispatched();
+                processed += sh->cons->processed();
+            }
+            fmt::print("{:5}   {:10}/{:<10}   g {:<10.0f} d {:<10.0f} c {:<10.0f}\n", now,
+                    queued, max_queued,
+                    prod->generated() / now.count(),
+                    dispatched / now.count(),
+                    processed / now.count()
+                    );
+#endif
+            _verb += seconds(1);
+        }
+
+        if (bounded) {
+            if (max_completed > 0 && st.count() >= max_completed) {
+                stopped_by = "completed requests";
+                break;
+            }
+            if (tail_samples > 0 && tail() >= tail_samples) {
+                stopped_by = "tail samples";
+                break;
+            }
+            // Clock is read once per thousand ticks
+            if (wall_budget.count() > 0.0 && ++ticks % 1000 == 0 &&
+                    steady_clock::now() - wall_start >= wall_budget) {
+                stopped_by = "wall-clock budget";
+                break;
+            }
+        }
+
+        if (realtime) {
+            now = steady_clock::now() - wall_start;
+        } else {
+            now += microseconds(1);
+        }
+    }
+
+    if (stats.on()) {
+        publish(now, true);
+    }
+    fmt::print("producer rate: {} consumer rate: {} maximum queued: {} executing: {}\n", prod_rate, cons_rate, max_queued, max_executed);
+    fmt::print("total latencies: mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n", st.mean_lat().count(), st.p95_lat().count(), st.p99_lat().count(), st.max_lat().count());
+    fmt::print("exec latencies:  mean {:.6f}  p95 {:.6f}  p99 {:.6f}  max {:.6f}\n", st.mean_xlat().count(), st.p95_xlat().count(), st.p99_xlat().count(), st.max_xlat().count());
+    if (shards.size() > 1) {
+        // Requests still in the shared queue belong to no consumer yet
+        auto routed_to = [&] (const shard& sh) { return sh.disp->dispatched() + (shared_queue ? 0 : sh.disp->queued()); };
+        unsigned long routed = 0;
+        unsigned long most = 0;
+        for (auto& sh : shards) {
+            routed += routed_to(*sh);
+            most = std::max(most, routed_to(*sh));
+        }
+        for (unsigned i = 0; i < shards.size(); i++) {
+            auto& sh = *shards[i];
+            unsigned long load = routed_to(sh);
+            fmt::print("consumer {:<4} routed {:<10} ({:5.1f}%)  processed {:<10}  utilization {:5.1f}%  maximum queued {:<8}  p99 {:.6f}  max {:.6f}\n", i,
+                    load, load * 100.0 / std::max(routed, 1ul), sh.st.count(), sh.cons->busy() / now * 100.0,
+                    sh.max_queued, sh.st.p99_lat().count(), sh.st.max_lat().count());
+        }
+        fmt::print("load skew: max/mean {:.3f}\n", most * double(shards.size()) / std::max(routed, 1ul));
+    }
+    if (steal.steals() > 0) {
+        fmt::print("stealing: steals {}  stolen {}  mean batch {:.1f}\n", steal.steals(), steal.stolen(), double(steal.stolen()) / steal.steals());
+    }
+    if (cache) {
+        fmt::print("cache: lookups {}  hits {}  hit ratio {:.2f}%\n", cache->lookups(), cache->hits(), cache->hits() * 100.0 / std::max(cache->lookups(), 1ul));
+    }
+    if (realtime) {
+        unsigned long failed = 0;
+        for (auto& sh : shards) {
+            failed += sh->cons->failed();
+        }
+        fmt::print("device: failed reads {}\n", failed);
+    }
+    drains.report();
+    if (rec) {
+        fmt::print("flight recorder: events {}  dumps {}\n", rec->events(), rec->dumps());
+    }
+    if (prof.on()) {
+        unsigned long polls = 0, dispatched = 0, processed = 0;
+        for (auto& sh : shards) {
+            polls += sh->disp->polls();
+            dispatched += sh->disp->dispatched();
+            processed += sh->cons->processed();
+        }
+        prof.report(steady_clock::now() - wall_start, prod->generated(), polls, dispatched, processed);
+    }
+    if (bounded) {
+        fmt::print("run: stopped by {} at {:.6f}s  completed {}  samples above p{:g} {}  wall time {:.3f}s\n", stopped_by, now.count(),
+                st.count(), tail_quantile * 100, tail(), duration<double>(steady_clock::now() - wall_start).count());
+    }
+#if VERB
+    fmt::print("request pool: allocs {}  chunks {}  live {}\n", pool.allocs(), pool.chunks(), pool.live());
+#endif
+    if (cons.completion_mode() != reaping::instant) {
+        duration<double> reap_delay(0.0), max_reap_delay(0.0);
+        unsigned long processed = 0;
+        for (auto& sh : shards) {
+            reap_delay += sh->cons->reap_delay();
+            max_reap_delay = std::max(max_reap_delay, sh->cons->max_reap_delay());
+            processed += sh->cons->processed();
+        }
+        fmt::print("reap delays:     mean {:.6f}  max {:.6f}\n", reap_delay.count() / std::max(processed, 1ul), max_reap_delay.count());
+    }
+    if (react) {
+        fmt::print("reactor: utilization {:.1f}%  polls {}  mean poll gap {:.6f}  max poll gap {:.6f}\n",
+                react->busy() / now * 100.0, react->polls(), now.count() / react->polls(), react->max_poll_gap().count());
+    }
     return 0;
 }
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fmt/core.h>
+
+// Live counters of a run, published in a memory-mapped file for sim-top.
+// The simulator is the only writer and never waits for readers: it bumps
+// the sequence to odd, writes and bumps it to even again, readers copy the
+// page and retry if the sequence was odd or changed meanwhile
+struct stats_values {
+    double now;           // simulated seconds
+    double duration;      // of the run in simulated seconds
+    double wall;          // seconds since the run started
+    double events;        // arrivals, dispatches and completions so far
+    double queued;
+    double executing;
+    double arrival_rate;  // per simulated second since the previous update
+    double dispatch_rate;
+    double completion_rate;
+    double completed;
+    double mean;          // total latency in usec
+    double p95;
+    double p99;
+    double max;
+    double done;          // 1 when the run is over
+};
+
+struct stats_page {
+    static constexpr uint64_t magic_value = 0x7374617473696d31; // "1mistats"
+
+    uint64_t magic;
+    uint64_t pid;
+    std::atomic<uint64_t> seq;
+    stats_values values;
+};
+
+class stats_writer {
+    stats_page* _page = nullptr;
+
+public:
+    stats_writer() = default;
+
+    explicit stats_writer(std::string path) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(stats_page)) < 0) {
+            throw std::runtime_error(fmt::format("cannot create {}: {}", path, strerror(errno)));
+        }
+        void* p = mmap(nullptr, sizeof(stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error(fmt::format("cannot map {}: {}", path, strerror(errno)));
+        }
+        _page = static_cast<stats_page*>(p);
+        _page->pid = getpid();
+        _page->seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        _page->magic = stats_page::magic_value;
+    }
+
+    stats_writer(const stats_writer&) = delete;
+
+    ~stats_writer() {
+        if (_page) {
+            munmap(_page, sizeof(stats_page));
+        }
+    }
+
+    bool on() const noexcept { return _page != nullptr; }
+
+    void publish(const stats_values& v) noexcept {
+        auto seq = _page->seq.load(std::memory_order_relaxed);
+        _page->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&_page->values, &v, sizeof(v));
+        _page->seq.store(seq + 2, std::memory_order_release);
+    }
+};
+
+class stats_reader {
+    const stats_page* _page;
+
+public:
+    explicit stats_reader(std::string path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            throw std::runtime_error(fmt::format("cannot open {}: {}", path, strerror(errno)));
+        }
+        if ((size_t)st.st_size < sizeof(stats_page)) {
+            close(fd);
+            throw std::runtime_error(fmt::format("{} is not a stats page", path));
+        }
+        void* p = mmap(nullptr, sizeof(stats_page), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error(fmt::format("cannot map {}: {}", path, strerror(errno)));
+        }
+        _page = static_cast<const stats_page*>(p);
+        if (_page->magic != stats_page::magic_value) {
+            munmap(const_cast<stats_page*>(_page), sizeof(stats_page));
+            throw std::runtime_error(fmt::format("{} is not a stats page", path));
+        }
+    }
+
+    stats_reader(const stats_reader&) = delete;
+
+    ~stats_reader() {
+        munmap(const_cast<stats_page*>(_page), sizeof(stats_page));
+    }
+
+    unsigned long pid() const noexcept { return _page->pid; }
+
+    stats_values read() const noexcept {
+        stats_values v;
+        for (;;) {
+            auto seq = _page->seq.load(std::memory_order_acquire);
+            memcpy(&v, const_cast<const stats_values*>(&_page->values), sizeof(v));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq % 2 == 0 && _page->seq.load(std::memory_order_relaxed) == seq) {
+                return v;
+            }
+        }
+    }
+};
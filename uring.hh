@@ -0,0 +1,145 @@
+#pragma once
+
+#include <fmt/core.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+// Minimal io_uring on top of the raw syscalls, just enough to submit
+// batches of fixed-buffer reads and writes and reap their completions
+class uring {
+    int _fd;
+    io_uring_params _p;
+
+    void* _sq_ring;
+    size_t _sq_ring_size;
+    void* _cq_ring;
+    size_t _cq_ring_size;
+    io_uring_sqe* _sqes;
+    size_t _sqes_size;
+
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned* _cq_mask;
+    io_uring_cqe* _cqes;
+
+    unsigned _prepared;
+
+    template <typename T>
+    static T* at(void* ring, unsigned off) {
+        return reinterpret_cast<T*>(static_cast<char*>(ring) + off);
+    }
+
+    static void* map(int fd, size_t size, off_t off) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error(fmt::format("cannot map io_uring: {}", strerror(errno)));
+        }
+        return ptr;
+    }
+
+public:
+    explicit uring(unsigned entries) : _prepared(0) {
+        memset(&_p, 0, sizeof(_p));
+        _fd = syscall(__NR_io_uring_setup, entries, &_p);
+        if (_fd < 0) {
+            throw std::runtime_error(fmt::format("cannot setup io_uring: {}", strerror(errno)));
+        }
+
+        _sq_ring_size = _p.sq_off.array + _p.sq_entries * sizeof(unsigned);
+        _cq_ring_size = _p.cq_off.cqes + _p.cq_entries * sizeof(io_uring_cqe);
+        _sqes_size = _p.sq_entries * sizeof(io_uring_sqe);
+        _sq_ring = map(_fd, _sq_ring_size, IORING_OFF_SQ_RING);
+        _cq_ring = map(_fd, _cq_ring_size, IORING_OFF_CQ_RING);
+        _sqes = static_cast<io_uring_sqe*>(map(_fd, _sqes_size, IORING_OFF_SQES));
+
+        _sq_head = at<unsigned>(_sq_ring, _p.sq_off.head);
+        _sq_tail = at<unsigned>(_sq_ring, _p.sq_off.tail);
+        _sq_mask = at<unsigned>(_sq_ring, _p.sq_off.ring_mask);
+        _sq_array = at<unsigned>(_sq_ring, _p.sq_off.array);
+        _cq_head = at<unsigned>(_cq_ring, _p.cq_off.head);
+        _cq_tail = at<unsigned>(_cq_ring, _p.cq_off.tail);
+        _cq_mask = at<unsigned>(_cq_ring, _p.cq_off.ring_mask);
+        _cqes = at<io_uring_cqe>(_cq_ring, _p.cq_off.cqes);
+    }
+
+    uring(const uring&) = delete;
+
+    ~uring() {
+        munmap(_sqes, _sqes_size);
+        munmap(_cq_ring, _cq_ring_size);
+        munmap(_sq_ring, _sq_ring_size);
+        close(_fd);
+    }
+
+    void register_buffers(const iovec* iov, unsigned nr) {
+        if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, iov, nr) < 0) {
+            throw std::runtime_error(fmt::format("cannot register buffers: {}", strerror(errno)));
+        }
+    }
+
+    // Prepares a fixed-buffer read or write, it's sent to the kernel by submit()
+    bool prepare(unsigned char opcode, int fd, void* buf, unsigned len, off_t off, unsigned buf_index, unsigned long user_data) {
+        unsigned tail = *_sq_tail + _prepared;
+        if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _p.sq_entries) {
+            return false;
+        }
+
+        unsigned idx = tail & *_sq_mask;
+        io_uring_sqe* sqe = &_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<unsigned long>(buf);
+        sqe->len = len;
+        sqe->off = off;
+        sqe->buf_index = buf_index;
+        sqe->user_data = user_data;
+        _sq_array[idx] = idx;
+        _prepared++;
+        return true;
+    }
+
+    // Submits everything prepared so far with one syscall, optionally
+    // waiting for wait_nr completions
+    void submit(unsigned wait_nr = 0) {
+        unsigned nr = _prepared;
+        __atomic_store_n(_sq_tail, *_sq_tail + nr, __ATOMIC_RELEASE);
+        _prepared = 0;
+
+        if (nr == 0 && wait_nr == 0) {
+            return;
+        }
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (syscall(__NR_io_uring_enter, _fd, nr, wait_nr, flags, nullptr, 0) < 0) {
+            if (errno != EINTR) {
+                throw std::runtime_error(fmt::format("cannot submit io: {}", strerror(errno)));
+            }
+            nr = 0;
+        }
+    }
+
+    // Calls fn(user_data, res) for every available completion
+    template <typename Func>
+    unsigned reap(Func&& fn) {
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned nr = tail - head;
+
+        for (; head != tail; head++) {
+            io_uring_cqe* cqe = &_cqes[head & *_cq_mask];
+            fn(cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        return nr;
+    }
+};